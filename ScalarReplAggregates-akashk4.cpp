@@ -21,63 +21,114 @@
 
 #define DEBUG_TYPE "scalarrepl"
 
+#include "ScalarReplAggregates-akashk4.h"
 #include "llvm/IR/Use.h"
 #include "llvm/IR/User.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/ADT/iterator.h"
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/Analysis/Loads.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Analysis/PtrUseVisitor.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/PromoteMemToReg.h"
 
 #include <vector>
 #include <map>
+#include <memory>
 
 using namespace llvm;
+using namespace llvm::PatternMatch;
+
+// Directory of the on-disk cache of transformed functions. Caching is off if
+// this is empty.
+static cl::opt<std::string> CacheDir("scalarrepl-akashk4-cache-dir", cl::init(""),
+                                     cl::Hidden,
+                                     cl::desc("Cache transformed functions in this directory"));
 
 namespace {
   struct SROA : public FunctionPass {
     static char ID; // Pass identification
     SROA() : FunctionPass(ID) { }
+    SROA(const ScalarReplAggregatesOptions &Opts) : FunctionPass(ID), PassOpts(Opts) { }
+
+    // Options given by whoever created the pass. Without them, the command
+    // line options are read when the pass runs.
+    Optional<ScalarReplAggregatesOptions> PassOpts;
+
+    // Slot numbering of the module, shared by all the cache keys.
+    std::unique_ptr<ModuleSlotTracker> MST;
+
+    bool doInitialization(Module &M) {
+        if(!CacheDir.empty())
+            MST.reset(new ModuleSlotTracker(&M));
+        return false;
+    }
+
+    bool doFinalization(Module &M) {
+        MST.reset();
+        return false;
+    }
 
     // Entry point for the overall scalar-replacement pass
     bool runOnFunction(Function &F);
 
     // getAnalysisUsage - List passes required by this pass.  We also know it
-    // will not alter the CFG, so say so.
-    virtual void getAnalysisUsage(AnalysisUsage &AU) const {
-        AU.addRequired<AssumptionCacheTracker>();
-     AU.addRequired<DominatorTreeWrapperPass>();
-	AU.setPreservesCFG();
-    }
+    // will not alter the CFG, so say so. Unless a function body may be
+    // swapped for one from the cache. Loops only matter to loop promotion.
+    virtual void getAnalysisUsage(AnalysisUsage &AU) const;
   };
 }
 
@@ -92,44 +143,184 @@ static RegisterPass<SROA> X("scalarrepl-akashk4",
 // This function is provided to you.
 FunctionPass *createMyScalarReplAggregatesPass() { return new SROA(); }
 
+FunctionPass *createMyScalarReplAggregatesPass(const ScalarReplAggregatesOptions &Opts) {
+    return new SROA(Opts);
+}
+
+// Add the pass to the standard pipeline, late in the function simplification
+// passes. Coroutines reach it before their frames are built only because the
+// legacy CoroSplit re-queues a presplit coroutine, so the function passes run
+// on it once more before it is split. Then only what is live across a suspend
+// point ends up in a frame.
+static cl::opt<bool> StandardPipeline("scalarrepl-akashk4-standard-pipeline", cl::init(false),
+                                      cl::Hidden,
+                                      cl::desc("Run the pass in the standard pipeline, before coroutines are split"));
+
+static RegisterStandardPasses Y(PassManagerBuilder::EP_ScalarOptimizerLate,
+                                [](const PassManagerBuilder &, legacy::PassManagerBase &PM) {
+                                    // Traces would flood the output of every compile
+                                    if(StandardPipeline) {
+                                        ScalarReplAggregatesOptions Opts;
+                                        Opts.Quiet = true;
+                                        PM.add(createMyScalarReplAggregatesPass(Opts));
+                                    }
+                                });
+
 STATISTIC(NumReplaced,  "Number of aggregate allocas broken up");
 STATISTIC(NumPromoted,  "Number of scalar allocas promoted to register");
+STATISTIC(NumLoopPromoted, "Number of alloca slots promoted to register within loops");
+STATISTIC(NumPunned,    "Number of allocas accessed as other types split into pieces");
+
+// Promote allocas that escape somewhere outside a loop to registers within
+// that loop, the same way LICM promotes globals.
+static cl::opt<bool> LoopPromote("scalarrepl-akashk4-loop-promote", cl::init(false),
+                                 cl::Hidden,
+                                 cl::desc("Promote escaping allocas to registers inside loops"));
+
+void SROA::getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<AssumptionCacheTracker>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    if(PassOpts ? PassOpts->LoopPromote : LoopPromote)
+        AU.addRequired<LoopInfoWrapperPass>();
+    if(CacheDir.empty())
+        AU.setPreservesCFG();
+}
+
+STATISTIC(NumForwarded, "Number of loads forwarded from stores to non-promotable allocas");
+STATISTIC(NumDeadStores, "Number of dead stores to non-promotable allocas removed");
+
+// Forward stores to loads and remove dead stores for allocas which cannot be
+// promoted to registers.
+static cl::opt<bool> ForwardStores("scalarrepl-akashk4-forward", cl::init(true),
+                                   cl::Hidden,
+                                   cl::desc("Forward stores and remove dead stores on non-promotable allocas"));
+
+STATISTIC(NumBitfields, "Number of bitfields split out of packed integer storage");
+
+// Split bitfields packed into one integer into allocas of their own.
+static cl::opt<bool> SplitBitfields("scalarrepl-akashk4-bitfields", cl::init(false),
+                                    cl::Hidden,
+                                    cl::desc("Split bitfield-packed integers into independent fields"));
+
+// Plan the allocas of large functions on several threads. Only the planning
+// runs concurrently, the IR is changed by one thread.
+static cl::opt<unsigned> AnalysisThreads("scalarrepl-akashk4-analysis-threads", cl::init(1),
+                                         cl::Hidden,
+                                         cl::desc("Number of threads analyzing allocas"));
+
+// Do not trace what the pass does on stderr. Tracing formats whole functions,
+// and streams are not safe to share between threads.
+static cl::opt<bool> Quiet("scalarrepl-akashk4-quiet", cl::init(false),
+                           cl::Hidden,
+                           cl::desc("Do not print what the pass does"));
+
+static cl::opt<unsigned> AnalysisThreshold("scalarrepl-akashk4-analysis-threshold", cl::init(256),
+                                           cl::Hidden,
+                                           cl::desc("Minimum number of allocas to analyze concurrently"));
+
+STATISTIC(NumOutOfBudget, "Number of functions the work budget ran out on");
+
+// Per-function limits on the work done, so that giant generated functions
+// cannot blow up compile time. Zero means no limit.
+static cl::opt<unsigned> MaxIterations("scalarrepl-akashk4-max-iterations", cl::init(0),
+                                       cl::Hidden,
+                                       cl::desc("Maximum number of split and promote rounds per function"));
+
+static cl::opt<unsigned> MaxAllocas("scalarrepl-akashk4-max-allocas", cl::init(0),
+                                    cl::Hidden,
+                                    cl::desc("Maximum number of allocas examined per function"));
+
+static cl::opt<unsigned> MaxRewrites("scalarrepl-akashk4-max-rewrites", cl::init(0),
+                                     cl::Hidden,
+                                     cl::desc("Maximum number of instructions rewritten per function"));
+
+STATISTIC(NumTransposed, "Number of arrays of structs turned into one array per field");
+
+// Lay out local arrays of small structs field by field, so that loops over
+// one field walk through memory with unit stride.
+static cl::opt<bool> StructOfArrays("scalarrepl-akashk4-soa", cl::init(false),
+                                    cl::Hidden,
+                                    cl::desc("Turn local arrays of small structs into one array per field"));
+
+STATISTIC(NumConstantCopies, "Number of allocas copied from a constant global replaced by the global");
+
+// Read the constant global directly instead of a local copy of it.
+static cl::opt<bool> ConstantCopies("scalarrepl-akashk4-constant-copies", cl::init(true),
+                                    cl::Hidden,
+                                    cl::desc("Replace read-only copies of constant globals with the global"));
+
+ScalarReplAggregatesOptions::ScalarReplAggregatesOptions()
+    : LoopPromote(::LoopPromote), ForwardStores(::ForwardStores),
+      SplitBitfields(::SplitBitfields), AnalysisThreads(::AnalysisThreads),
+      AnalysisThreshold(::AnalysisThreshold), MaxIterations(::MaxIterations),
+      MaxAllocas(::MaxAllocas), MaxRewrites(::MaxRewrites),
+      StructOfArrays(::StructOfArrays), ConstantCopies(::ConstantCopies),
+      Quiet(::Quiet) { }
+
+// Work done on a function so far, against the limits of the options.
+struct WorkBudget {
+    const ScalarReplAggregatesOptions &Opts;
+    unsigned Iterations = 0;
+    unsigned Allocas = 0;
+    unsigned Rewrites = 0;
+
+    WorkBudget(const ScalarReplAggregatesOptions &Opts) : Opts(Opts) { }
+
+    // Returns the limit which ran out, if any.
+    const char *exhausted() const {
+        if(Opts.MaxIterations && Iterations >= Opts.MaxIterations)
+            return "iteration";
+        if(Opts.MaxAllocas && Allocas >= Opts.MaxAllocas)
+            return "alloca";
+        if(Opts.MaxRewrites && Rewrites >= Opts.MaxRewrites)
+            return "rewrite";
+        return nullptr;
+    }
+};
+
+// Detail of a time trace region: the function and the allocas it deals with.
+// Only built when the region is actually recorded.
+static std::string TraceDetail(const Function &F, size_t NumAllocas) {
+    return (F.getName() + " allocas=" + Twine(NumAllocas)).str();
+}
 
 // Invoke the Mem2reg pass
 static  bool PromoteAllocas(std::vector<AllocaInst *> &AllocaList, Function &F, 
                             DominatorTree &DT, AssumptionCache &AC) {
     if(AllocaList.empty())
         return false;
+    TimeTraceScope Scope("SROAPromoteMemToReg",
+                         [&] { return TraceDetail(F, AllocaList.size()); });
     NumPromoted += AllocaList.size();
     PromoteMemToReg(AllocaList, DT, &AC);
     return true;
 }
 
+static bool isLifetimeMarker(const Value *V) {
+    const auto *II = dyn_cast<IntrinsicInst>(V);
+    return II && II->isLifetimeStartOrEnd();
+}
+
 // Perfoms some analysis as to whether SROA should be performed on an alloca.
 static bool isPromotable(const Instruction *I, SmallVector<Instruction *, 4> &BitCastAlloca) {
      for(const auto *U : I->users()) {
         if(const auto *LI = dyn_cast<LoadInst>(U)) {
-            errs() << "--LOAD: " << *LI << "\n";
             if(LI->isVolatile())
                 return false;
-            errs() << "LOAD: " << *LI << "\n";
             continue;
         }
         if(const auto *SI = dyn_cast<StoreInst>(U)) {
-            errs() << "--STORE: " << *SI << "\n";
             if(SI->getOperand(0) == I || SI->isVolatile())
                 return false;
-            errs() << "STORE: " << *SI << "\n";
             continue;
         }
         if(const auto *GEP = dyn_cast<GetElementPtrInst>(U)) {
-            errs() << "--GEP: " << *GEP << "\n";
             // All indices should be constants
-            if(!isa<ConstantInt>(GEP->getOperand(1)) 
+            if(GEP->getNumIndices() != 2
+            || !isa<ConstantInt>(GEP->getOperand(1)) 
             || !isa<ConstantInt>(GEP->getOperand(2))) {
                 return false;
             }
-            errs() << "GEP: " << *GEP << "\n";
             if(!dyn_cast<PointerType>(GEP->getType())->getElementType()->isPointerTy()) {
                 if(!isPromotable(GEP, BitCastAlloca))
                     return false;
@@ -146,15 +337,12 @@ static bool isPromotable(const Instruction *I, SmallVector<Instruction *, 4> &Bi
         }
         if(const auto *BCI = dyn_cast<BitCastInst>(U)) {
             if(auto *AI = dyn_cast<AllocaInst>(I)) {
-                errs() << "ALLOCA LEVEL\n";
                 // There are conditions that have to be met.
                 // This only works for arrays and vectors.
                 //if(isa<SequentialType>(AI->getAllocatedType())) {
-                    errs() << "ALLOCA TYPE LEVEL\n";
                     const DataLayout &DL = AI->getModule()->getDataLayout();
                     if(DL.getTypeAllocSize(BCI->getDestTy())
                         == DL.getTypeAllocSize(BCI->getSrcTy())) {
-                        errs() << "ALLOCA DATA LAYOUT LEVEL\n";
                         BitCastAlloca.push_back(const_cast<BitCastInst *>(BCI));
                     }
                 //}
@@ -167,7 +355,6 @@ static bool isPromotable(const Instruction *I, SmallVector<Instruction *, 4> &Bi
             continue;
         }
         if(const auto *II = dyn_cast<IntrinsicInst>(U)) {
-            errs() << "INTRINSIC\n";
             if(!II->isLifetimeStartOrEnd())
                 return false;
             continue;
@@ -247,69 +434,174 @@ static void ExtractOffsets(AllocaInst &AI, SmallVector<Instruction *, 4> &BitCas
     }
 }
 
-static bool AnalyzeAlloca(AllocaInst *AI, SmallVector<AllocaInst *, 4> &Worklist, 
-                            SmallVector<AllocaInst *, 4> &TryPromotelist) {
-    errs() << "ANALYZING ALLOCA: " << *AI << "\n";
+// Keeps track of allocas whose address is stored into other allocas. Such an
+// alloca cannot be promoted while the store is around, but once the holding
+// alloca is split or promoted, the store may be gone and it is worth another
+// look.
+struct AddressHolders {
+    DenseMap<AllocaInst *, SmallVector<AllocaInst *, 2>> Dependents;
+    SmallSetVector<AllocaInst *, 4> Requeue;
+
+    // Records the allocas the address of this alloca is stored into.
+    void record(AllocaInst *AI) {
+        const DataLayout &DL = AI->getModule()->getDataLayout();
+        for(auto *U : AI->users()) {
+            Value *Addr = AI;
+            auto *SI = dyn_cast<StoreInst>(U);
+            if(!SI && (isa<BitCastInst>(U) || isa<GetElementPtrInst>(U)) && U->hasOneUse()) {
+                Addr = U;
+                SI = dyn_cast<StoreInst>(*U->user_begin());
+            }
+            if(!SI || SI->getValueOperand() != Addr)
+                continue;
+            auto *Holder = dyn_cast<AllocaInst>(GetUnderlyingObject(SI->getPointerOperand(), DL));
+            if(!Holder || Holder == AI)
+                continue;
+            auto &Held = Dependents[Holder];
+            if(!is_contained(Held, AI))
+                Held.push_back(AI);
+        }
+    }
+
+    // Queues up the allocas held by this alloca for another look.
+    void release(AllocaInst *Holder) {
+        auto It = Dependents.find(Holder);
+        if(It == Dependents.end())
+            return;
+        Requeue.insert(It->second.begin(), It->second.end());
+        Dependents.erase(It);
+    }
+
+    // Called right before an alloca is erased.
+    void erase(AllocaInst *AI) {
+        release(AI);
+        Requeue.remove(AI);
+        for(auto &Entry : Dependents)
+            llvm::erase_if(Entry.second, [&](AllocaInst *Held) { return Held == AI; });
+    }
+};
+
+// What to do with an alloca. Plans are made without touching the IR, and a
+// plan only refers to the alloca and its own users, so plans for different
+// allocas can be made concurrently and committed one after another.
+struct AllocaPlan {
+    enum PlanKind { Erase, TryPromote, Skip, Split };
+    AllocaInst *AI;
+    PlanKind Kind;
+    const char *Reason;
+    std::map<uint64_t, std::vector<GetElementPtrInst *>> OffsetsGEPsMap;
+};
+
+// The time trace profiler is not thread-safe, so allocas planned on the
+// thread pool are planned with Trace off.
+static void PlanAlloca(AllocaInst *AI, AllocaPlan &Plan, bool Trace = true) {
+    Plan.AI = AI;
+    Plan.Reason = nullptr;
+
     // If alloca has no use, remove the useless thing.
     if(AI->use_empty()) {
-        AI->eraseFromParent();
-        return true;
+        Plan.Kind = AllocaPlan::Erase;
+        return;
     }
 
     // Skip any alloca which is not a struct or an array
     //if(!AI->getAllocatedType()->isStructTy() && !AI->isArrayAllocation()) {
     if(!isa<CompositeType>(AI->getAllocatedType()) && !isa<SequentialType>(AI->getAllocatedType())) {
-        errs() << "NOT AN ARRAY NOR STRUCT\n";
-        TryPromotelist.push_back(AI);
-        return false;
+        Plan.Kind = AllocaPlan::TryPromote;
+        Plan.Reason = "NOT AN ARRAY NOR STRUCT";
+        return;
     }
 
     // If the size of array or vector is more than 5, abort mission.
     if(auto *SeqTy = dyn_cast<SequentialType>(AI->getAllocatedType())) {
         if(SeqTy->getNumElements() > 5) {
-            errs() << "ARRAY/VECTOR TOO BIG\n";
-            return false;
+            Plan.Kind = AllocaPlan::Skip;
+            Plan.Reason = "ARRAY/VECTOR TOO BIG";
+            return;
         }
     }
 
     // We can deal with small arrays, but not zero size.
     const DataLayout &DL = AI->getModule()->getDataLayout();
     if(!DL.getTypeAllocSize(AI->getAllocatedType())) {
-        errs() << "DATA LAYOUT ABORT\n";
-        TryPromotelist.push_back(AI);
-        return false;
+        Plan.Kind = AllocaPlan::TryPromote;
+        Plan.Reason = "DATA LAYOUT ABORT";
+        return;
     }
 
     // Is this alloca promotable?
+    const Function &F = *AI->getFunction();
     SmallVector<Instruction *, 4> BitCastAlloca;
-    if(!isPromotable(AI, BitCastAlloca)) {
-        errs() << "ALLOCA CANNOT SROA\n";
-        TryPromotelist.push_back(AI);
-        return false;
+    {
+        Optional<TimeTraceScope> Scope;
+        if(Trace)
+            Scope.emplace("SROAIsPromotable", [&] { return TraceDetail(F, 1); });
+        if(!isPromotable(AI, BitCastAlloca)) {
+            Plan.Kind = AllocaPlan::TryPromote;
+            Plan.Reason = "ALLOCA CANNOT SROA";
+            return;
+        }
     }
 
     // Now, we extract specific elements of the aggregate alloca
     // and use them separately.
-    std::map<uint64_t, std::vector<GetElementPtrInst *>> OffsetsGEPsMap;
-    ExtractOffsets(*AI, BitCastAlloca, OffsetsGEPsMap);
-    errs() << "OFFSETS EXTRACTED\n";
+    {
+        Optional<TimeTraceScope> Scope;
+        if(Trace)
+            Scope.emplace("SROAExtractOffsets", [&] { return TraceDetail(F, 1); });
+        ExtractOffsets(*AI, BitCastAlloca, Plan.OffsetsGEPsMap);
+    }
+    Plan.Kind = AllocaPlan::Split;
+    Plan.Reason = "OFFSETS EXTRACTED";
+}
+
+static bool CommitAlloca(AllocaPlan &Plan, SmallVector<AllocaInst *, 4> &Worklist,
+                         SmallVector<AllocaInst *, 4> &TryPromotelist,
+                         AddressHolders &Holders, WorkBudget &Budget,
+                         const ScalarReplAggregatesOptions &Opts) {
+    AllocaInst *AI = Plan.AI;
+    Budget.Allocas++;
+    if(!Opts.Quiet) {
+        errs() << "ANALYZING ALLOCA: " << *AI << "\n";
+        if(Plan.Reason)
+            errs() << Plan.Reason << "\n";
+    }
+    switch(Plan.Kind) {
+    case AllocaPlan::Erase:
+        Holders.erase(AI);
+        AI->eraseFromParent();
+        return true;
+    case AllocaPlan::Skip:
+        return false;
+    case AllocaPlan::TryPromote:
+        TryPromotelist.push_back(AI);
+        return false;
+    case AllocaPlan::Split:
+        break;
+    }
 
     // Deal with the alloca one offset at a time. Offsets that we do not
     // deal with here are useless anyway. So this pass is justified in 
     // removing those values.
     //auto *FirstInst = AI->getParent()->getFirstNonPHI();
-    for(auto &Entry : OffsetsGEPsMap) {
+    TimeTraceScope Scope("SROARewriteAlloca", [&] {
+        return TraceDetail(*AI->getFunction(), Plan.OffsetsGEPsMap.size());
+    });
+    for(auto &Entry : Plan.OffsetsGEPsMap) {
         uint64_t Offset = Entry.first;
-        errs()  << "CONSIDERING OFFSET: " << Offset << "\n";
+        if(!Opts.Quiet)
+            errs()  << "CONSIDERING OFFSET: " << Offset << "\n";
         auto &GEPVect = Entry.second;
         
         // Create an alloca for element at given offset
         Type *AllocType;
         if(auto *SeqAllocType = dyn_cast<SequentialType>(AI->getAllocatedType())) {
-            errs() << "ARRAY OR VECTOR\n";
+            if(!Opts.Quiet)
+                errs() << "ARRAY OR VECTOR\n";
             AllocType = SeqAllocType->getElementType();
         } else {
-            errs() << "STRUCT TYPE\n";
+            if(!Opts.Quiet)
+                errs() << "STRUCT TYPE\n";
             // Its composite type
             auto *CompAllocType = dyn_cast<CompositeType>(AI->getAllocatedType());
             assert(CompAllocType && "Alloca should be of conposite type.");
@@ -317,13 +609,16 @@ static bool AnalyzeAlloca(AllocaInst *AI, SmallVector<AllocaInst *, 4> &Worklist
         }
         auto *NewAlloca = new AllocaInst(AllocType, 
                             AI->getType()->getAddressSpace(), "", AI);
-        errs() << "NEW ALLOCA: " << *NewAlloca << "\n";
+        if(!Opts.Quiet)
+            errs() << "NEW ALLOCA: " << *NewAlloca << "\n";
         NumReplaced++;
         
         // Replace the uses of this GEP with the new Alloca
        std::vector<BitCastInst *> BitCastVect;
+        Budget.Rewrites += GEPVect.size();
         for(auto *GEP : GEPVect) {
-            errs() << "CONSIDERED GEP: " << *GEP << "\n";
+            if(!Opts.Quiet)
+                errs() << "CONSIDERED GEP: " << *GEP << "\n";
             auto *GEPTy = GEP->getPointerOperand()->getType();
             if(GEP->getPointerOperand() != AI) {
                 BitCastInst *BI = nullptr;
@@ -344,81 +639,2275 @@ static bool AnalyzeAlloca(AllocaInst *AI, SmallVector<AllocaInst *, 4> &Worklist
                 GEP->replaceAllUsesWith(NewAlloca);
             }
         }
-        errs() << "OUT\n";
+        if(!Opts.Quiet)
+            errs() << "OUT\n";
         // Add the new alloca to the worklist
         Worklist.push_back(NewAlloca);
     }
 
     // Invalidate and remove the old alloca
-    if(!OffsetsGEPsMap.empty()) {
+    if(!Plan.OffsetsGEPsMap.empty()) {
         AI->replaceAllUsesWith(UndefValue::get(AI->getType()));
+        Holders.erase(AI);
         AI->eraseFromParent();
     } else {
         TryPromotelist.push_back(AI);
     }
-    errs() << "OLD ALLOCA ERASED FROM PARENT\n";
+    if(!Opts.Quiet)
+        errs() << "OLD ALLOCA ERASED FROM PARENT\n";
     return true;
 }
 
-static bool RunOnFunction(Function &F, DominatorTree &DT,
-                                       AssumptionCache &AC) {
-    errs() << "RUN ON FUNCTION:" << F.getName() << " \n";
+static bool AnalyzeAlloca(AllocaInst *AI, SmallVector<AllocaInst *, 4> &Worklist, 
+                            SmallVector<AllocaInst *, 4> &TryPromotelist,
+                            AddressHolders &Holders, WorkBudget &Budget,
+                            const ScalarReplAggregatesOptions &Opts) {
+    AllocaPlan Plan;
+    PlanAlloca(AI, Plan);
+    return CommitAlloca(Plan, Worklist, TryPromotelist, Holders, Budget, Opts);
+}
 
-    // Get all allocas first
-    SmallVector<AllocaInst *, 4> Worklist;
-    for(auto &I : F.getEntryBlock()) {
-        if(auto *AI = dyn_cast<AllocaInst>(&I))
-            Worklist.push_back(AI);
+// Plans the allocas of the worklist on the thread pool, then commits the
+// plans in the order the worklist would have been processed in. Only as many
+// allocas as the budget still allows are planned, and once the budget runs
+// out, the allocas not committed are left on the worklist.
+static bool AnalyzeAllocasConcurrently(SmallVector<AllocaInst *, 4> &Worklist,
+                                       SmallVector<AllocaInst *, 4> &NewWorklist,
+                                       SmallVector<AllocaInst *, 4> &TryPromotelist,
+                                       AddressHolders &Holders, WorkBudget &Budget,
+                                       const ScalarReplAggregatesOptions &Opts,
+                                       ThreadPool &Pool) {
+    // The worklist is processed from the back.
+    unsigned First = 0;
+    if(Opts.MaxAllocas) {
+        unsigned Allowed = Opts.MaxAllocas > Budget.Allocas ? Opts.MaxAllocas - Budget.Allocas : 0;
+        if(Allowed < Worklist.size())
+            First = Worklist.size() - Allowed;
+    }
+    if(First == Worklist.size())
+        return false;
+
+    // The data layout caches struct layouts as they are asked for. Fill the
+    // cache up front so that the planning threads only ever read it.
+    const DataLayout &DL = Worklist.front()->getModule()->getDataLayout();
+    for(unsigned i = First; i < Worklist.size(); ++i)
+        DL.getTypeAllocSize(Worklist[i]->getAllocatedType());
+
+    TimeTraceScope Scope("SROAPlanAllocas", [&] {
+        return TraceDetail(*Worklist.front()->getFunction(), Worklist.size() - First);
+    });
+    std::vector<AllocaPlan> Plans(Worklist.size() - First);
+    unsigned Chunk = (Plans.size() + Opts.AnalysisThreads - 1) / Opts.AnalysisThreads;
+    for(unsigned Begin = 0; Begin < Plans.size(); Begin += Chunk) {
+        unsigned End = std::min<unsigned>(Begin + Chunk, Plans.size());
+        Pool.async([&, Begin, End] {
+            for(unsigned i = Begin; i < End; ++i)
+                PlanAlloca(Worklist[First + i], Plans[i], /*Trace=*/false);
+        });
     }
+    Pool.wait();
 
     bool Changed = false;
-    SmallVector<AllocaInst *, 4> TempWorklist;
-    do {
-        errs() << "PRINTING FUNCTION BEFORE ANALYSIS: \n";
-        F.print(errs());
-        SmallVector<AllocaInst *, 4> TryPromotelist;
-        while(!Worklist.empty()) 
-            Changed |= AnalyzeAlloca(Worklist.pop_back_val(), TempWorklist, TryPromotelist);
-        errs() << "PRINTING FUNCTION AFTER ANALYSIS: \n";
-        F.print(errs());
-        TryPromotelist.append(TempWorklist.begin(), TempWorklist.end());
-        std::vector<AllocaInst *> AllocaList;
-        for(auto *AI : TryPromotelist) {
-            errs() << "TRY ALLOCA: " << *AI << "\n";
-            if(isPromotableAlloca(AI)) {
-                AllocaList.push_back(AI);
-                errs() << "YES\n";
-            } else {
-                errs() << "NOT\n";
-            }
+    unsigned Left = Plans.size();
+    for(; Left && !Budget.exhausted(); --Left)
+        Changed |= CommitAlloca(Plans[Left - 1], NewWorklist, TryPromotelist, Holders, Budget,
+                                Opts);
+    Worklist.resize(First + Left);
+    return Changed;
+}
+
+// Moves loads, stores and address computations based on an addrspacecast of
+// an alloca over to the alloca's own address space. Pointers never go through
+// integers here, so this is fine for non-integral address spaces as well.
+static bool RewriteAddrSpaceCastUsers(Instruction *Cast, Value *NewPtr) {
+    bool Changed = false;
+    unsigned AddrSpace = NewPtr->getType()->getPointerAddressSpace();
+    SmallVector<User *, 8> Users(Cast->user_begin(), Cast->user_end());
+    for(auto *U : Users) {
+        if(auto *LI = dyn_cast<LoadInst>(U)) {
+            LI->setOperand(LI->getPointerOperandIndex(), NewPtr);
+            Changed = true;
+            continue;
         }
-        Changed |= PromoteAllocas(AllocaList, F, DT, AC);
-        errs() << "PRINTING FUNCTION AFTER PROMOTION: \n";
-        F.print(errs());
-        for(auto *AI : AllocaList) {
-            auto It = find(TempWorklist, AI);
-            if(It == TempWorklist.end())
+        if(auto *SI = dyn_cast<StoreInst>(U)) {
+            if(SI->getValueOperand() == Cast)
                 continue;
-            TempWorklist.erase(It);
+            SI->setOperand(SI->getPointerOperandIndex(), NewPtr);
+            Changed = true;
+            continue;
+        }
+        // Lifetime markers are typed on the address space. Recreate them on
+        // the new pointer, so that they still pair up with markers placed on
+        // the alloca itself.
+        if(isLifetimeMarker(U)) {
+            auto *II = cast<IntrinsicInst>(U);
+            auto *Size = cast<ConstantInt>(II->getArgOperand(0));
+            IRBuilder<> B(II);
+            if(II->getIntrinsicID() == Intrinsic::lifetime_start)
+                B.CreateLifetimeStart(NewPtr, Size);
+            else
+                B.CreateLifetimeEnd(NewPtr, Size);
+            II->eraseFromParent();
+            Changed = true;
+            continue;
+        }
+
+        Instruction *NewI;
+        if(auto *GEP = dyn_cast<GetElementPtrInst>(U)) {
+            if(GEP->getPointerOperand() != Cast)
+                continue;
+            SmallVector<Value *, 4> Indices(GEP->idx_begin(), GEP->idx_end());
+            auto *NewGEP = GetElementPtrInst::Create(GEP->getSourceElementType(), NewPtr,
+                                                     Indices, GEP->getName(), GEP);
+            NewGEP->setIsInBounds(GEP->isInBounds());
+            NewI = NewGEP;
+        } else if(auto *BCI = dyn_cast<BitCastInst>(U)) {
+            auto *DestTy = dyn_cast<PointerType>(BCI->getType());
+            if(!DestTy)
+                continue;
+            NewI = new BitCastInst(NewPtr, PointerType::get(DestTy->getElementType(), AddrSpace),
+                                   BCI->getName(), BCI);
+        } else {
+            continue;
         }
-        Worklist = TempWorklist;
-        TempWorklist.clear();
-    } while(!Worklist.empty());
 
+        auto *I = cast<Instruction>(U);
+        Changed |= RewriteAddrSpaceCastUsers(I, NewI);
+        if(NewI->use_empty())
+            NewI->eraseFromParent();
+        if(I->use_empty())
+            I->eraseFromParent();
+    }
     return Changed;
 }
 
-bool SROA::runOnFunction(Function &F) {
- // Get dominator tree and assumptions cache
-    auto &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-    auto &AC = getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F);
+// Allocas outside of the default address space are often only used through
+// an addrspacecast. Access them directly instead, so they can be split and
+// promoted like any other alloca.
+static bool RewriteAddrSpaceCasts(AllocaInst *AI) {
+    SmallVector<AddrSpaceCastInst *, 2> Casts;
+    for(auto *U : AI->users()) {
+        if(auto *ASC = dyn_cast<AddrSpaceCastInst>(U))
+            Casts.push_back(ASC);
+    }
+    bool Changed = false;
+    for(auto *ASC : Casts) {
+        Changed |= RewriteAddrSpaceCastUsers(ASC, AI);
+        if(ASC->use_empty())
+            ASC->eraseFromParent();
+    }
+    return Changed;
+}
 
-    // Run the analysis
-    bool Changed = RunOnFunction(F, DT, AC);
+// Allocas which would need more pieces than this are left alone
+static const unsigned MaxPunnedPieces = 16;
 
-    // Print the stats
-    errs() << "Number of aggregate allocas broken up: " << NumReplaced << "\n";
-    errs() << "Number of scalar allocas promoted to register: " << NumPromoted << "\n";
+// A load, store, memset or memory transfer of a byte range of an alloca,
+// found through bitcasts and GEPs with constant indices. Elem picks one
+// element of a stored aggregate, and is -1 otherwise. Ty is null for
+// memsets and transfers.
+struct PunnedAccess {
+    Instruction *I;
+    uint64_t Begin;
+    uint64_t End;
+    Type *Ty;
+    int Elem;
+};
 
-    return Changed;
+// A byte range of an alloca which gets an alloca of its own.
+struct PunnedPiece {
+    uint64_t Begin;
+    uint64_t End;
+    Type *Ty;
+    AllocaInst *Alloca;
+    DenseMap<Type *, Value *> Casts;    // The piece's address as other types
+};
+
+// Collects the accesses of an alloca, along with the pointers derived from it
+// and the lifetime markers on them. Fails if the alloca is used in any other
+// way, or its address is stored or compared.
+static bool CollectPunnedAccesses(AllocaInst *AI, SmallVectorImpl<PunnedAccess> &Accesses,
+                                  SmallVectorImpl<Instruction *> &Pointers,
+                                  SmallVectorImpl<Instruction *> &Markers,
+                                  SmallPtrSetImpl<Value *> &Derived) {
+    const DataLayout &DL = AI->getModule()->getDataLayout();
+    SmallVector<std::pair<Instruction *, uint64_t>, 8> Worklist;
+    Worklist.push_back(std::make_pair(AI, 0));
+    Derived.insert(AI);
+    while(!Worklist.empty()) {
+        Instruction *Ptr = Worklist.back().first;
+        uint64_t Offset = Worklist.back().second;
+        Worklist.pop_back();
+        for(auto *U : Ptr->users()) {
+            auto *UI = cast<Instruction>(U);
+            if(isa<BitCastInst>(UI) || isa<GetElementPtrInst>(UI)) {
+                uint64_t NewOffset = Offset;
+                if(auto *GEP = dyn_cast<GetElementPtrInst>(UI)) {
+                    APInt GEPOffset(DL.getIndexTypeSizeInBits(GEP->getType()), 0);
+                    if(!GEP->accumulateConstantOffset(DL, GEPOffset) || GEPOffset.isNegative())
+                        return false;
+                    NewOffset += GEPOffset.getZExtValue();
+                }
+                Derived.insert(UI);
+                Pointers.push_back(UI);
+                Worklist.push_back(std::make_pair(UI, NewOffset));
+                continue;
+            }
+            if(isLifetimeMarker(UI)) {
+                Markers.push_back(UI);
+                continue;
+            }
+            if(auto *LI = dyn_cast<LoadInst>(UI)) {
+                Type *Ty = LI->getType();
+                if(!LI->isSimple() || !Ty->isSingleValueType())
+                    return false;
+                Accesses.push_back({LI, Offset, Offset + DL.getTypeStoreSize(Ty), Ty, -1});
+                continue;
+            }
+            if(auto *SI = dyn_cast<StoreInst>(UI)) {
+                Type *Ty = SI->getValueOperand()->getType();
+                if(!SI->isSimple() || SI->getValueOperand() == Ptr)
+                    return false;
+                if(Ty->isSingleValueType()) {
+                    Accesses.push_back({SI, Offset, Offset + DL.getTypeStoreSize(Ty), Ty, -1});
+                    continue;
+                }
+                // Stored aggregates are taken apart, one level deep
+                auto *STy = dyn_cast<StructType>(Ty);
+                auto *ATy = dyn_cast<ArrayType>(Ty);
+                unsigned NumElems = STy ? STy->getNumElements() : ATy ? ATy->getNumElements() : 0;
+                if(!NumElems || NumElems > MaxPunnedPieces)
+                    return false;
+                for(unsigned i = 0; i < NumElems; ++i) {
+                    Type *ElemTy = STy ? STy->getElementType(i) : ATy->getElementType();
+                    if(!ElemTy->isSingleValueType())
+                        return false;
+                    uint64_t ElemOffset = Offset + (STy ? DL.getStructLayout(STy)->getElementOffset(i)
+                                                        : i * DL.getTypeAllocSize(ElemTy));
+                    Accesses.push_back({SI, ElemOffset, ElemOffset + DL.getTypeStoreSize(ElemTy),
+                                        ElemTy, int(i)});
+                }
+                continue;
+            }
+            if(auto *MI = dyn_cast<MemIntrinsic>(UI)) {
+                auto *Len = dyn_cast<ConstantInt>(MI->getLength());
+                if(MI->isVolatile() || !Len || (isa<MemSetInst>(MI)
+                    && (MI->getRawDest() != Ptr || !isa<ConstantInt>(cast<MemSetInst>(MI)->getValue()))))
+                    return false;
+                Accesses.push_back({MI, Offset, Offset + Len->getZExtValue(), nullptr, -1});
+                continue;
+            }
+            return false;
+        }
+    }
+
+    // Copies from one part of the alloca to another are not taken apart
+    for(auto &Access : Accesses) {
+        auto *MTI = dyn_cast<MemTransferInst>(Access.I);
+        if(MTI && Derived.count(MTI->getRawSource()) && Derived.count(MTI->getRawDest()))
+            return false;
+    }
+    return true;
+}
+
+// Whether an access spanning several pieces is a load or store copying the
+// value to or from memory outside of the alloca. The copy is then done piece
+// by piece, whatever the type of the value.
+static LoadInst *getCopiedInLoad(const PunnedAccess &Access, const SmallPtrSetImpl<Value *> &Derived) {
+    auto *SI = dyn_cast<StoreInst>(Access.I);
+    auto *LI = SI && Access.Elem < 0 ? dyn_cast<LoadInst>(SI->getValueOperand()) : nullptr;
+    if(!LI || !LI->isSimple() || !LI->hasOneUse() || Derived.count(LI->getPointerOperand()))
+        return nullptr;
+    return LI;
+}
+
+static StoreInst *getCopiedOutStore(const PunnedAccess &Access, const SmallPtrSetImpl<Value *> &Derived) {
+    auto *LI = dyn_cast<LoadInst>(Access.I);
+    auto *SI = LI && LI->hasOneUse() ? dyn_cast<StoreInst>(*LI->user_begin()) : nullptr;
+    if(!SI || !SI->isSimple() || SI->getValueOperand() != LI || Derived.count(SI->getPointerOperand()))
+        return nullptr;
+    return SI;
+}
+
+// Address of the given type at a byte offset from a pointer outside of the
+// alloca, in the address space of that pointer.
+static Value *GetBytePointer(IRBuilder<> &B, Value *Base, uint64_t Offset, Type *Ty) {
+    const DataLayout &DL = B.GetInsertBlock()->getModule()->getDataLayout();
+    unsigned AddrSpace = Base->getType()->getPointerAddressSpace();
+    if(!Offset)
+        return B.CreateBitCast(Base, PointerType::get(Ty, AddrSpace));
+    Value *Ptr = B.CreateBitCast(Base, B.getInt8PtrTy(AddrSpace));
+    Ptr = B.CreateInBoundsGEP(B.getInt8Ty(), Ptr,
+                              B.getIntN(DL.getIndexSizeInBits(AddrSpace), Offset));
+    return B.CreateBitCast(Ptr, PointerType::get(Ty, AddrSpace));
+}
+
+// Splits an alloca which is accessed as different types, e.g. through a
+// bitcast to another pointer type, into pieces at the boundaries of the
+// accesses. Each piece takes the type it is first accessed as. Accesses as
+// another type of the same size become a bitcast of the value where the
+// types allow it, and of the piece's address otherwise; pointers are never
+// converted to or from integers, so this holds for non-integral address
+// spaces as well. Integers spanning several pieces are put together or taken
+// apart with shifts, and copies to or from other memory are done piece by
+// piece. Everything stays in the alloca's address space. The new allocas go
+// into NewAllocas.
+static bool RewritePunnedAlloca(AllocaInst *AI, SmallVectorImpl<AllocaInst *> &NewAllocas,
+                                WorkBudget &Budget) {
+    if(AI->isArrayAllocation())
+        return false;
+    SmallVector<PunnedAccess, 8> Accesses;
+    SmallVector<Instruction *, 8> Pointers;
+    SmallVector<Instruction *, 4> Markers;
+    SmallPtrSet<Value *, 8> Derived;
+    if(!CollectPunnedAccesses(AI, Accesses, Pointers, Markers, Derived) || Accesses.empty())
+        return false;
+
+    // Bytes past the end of the alloca do not exist. Only integer stores may
+    // reach over the end, and only their bytes within it are kept.
+    const DataLayout &DL = AI->getModule()->getDataLayout();
+    uint64_t Size = DL.getTypeAllocSize(AI->getAllocatedType());
+    auto Skipped = [&](const PunnedAccess &A) { return A.Begin >= Size || A.Begin == A.End; };
+    auto isSplittableInt = [&](Type *Ty) {
+        return Ty && Ty->isIntegerTy() && DL.getTypeSizeInBits(Ty) == DL.getTypeStoreSizeInBits(Ty);
+    };
+    std::vector<uint64_t> Bounds;
+    for(auto &Access : Accesses) {
+        if(Access.End > Size && !(isa<StoreInst>(Access.I) && isSplittableInt(Access.Ty)))
+            return false;
+        if(Skipped(Access))
+            continue;
+        Bounds.push_back(Access.Begin);
+        Bounds.push_back(std::min(Access.End, Size));
+    }
+    llvm::sort(Bounds);
+    Bounds.erase(std::unique(Bounds.begin(), Bounds.end()), Bounds.end());
+
+    // Every range between two bounds which is accessed at all is a piece
+    SmallVector<PunnedPiece, 8> Pieces;
+    for(unsigned i = 0; i + 1 < Bounds.size(); ++i) {
+        bool Used = any_of(Accesses, [&](const PunnedAccess &A) {
+            return A.Begin <= Bounds[i] && std::min(A.End, Size) >= Bounds[i + 1];
+        });
+        if(Used)
+            Pieces.push_back({Bounds[i], Bounds[i + 1], nullptr, nullptr, {}});
+    }
+    if(Pieces.empty() || Pieces.size() > MaxPunnedPieces)
+        return false;
+    auto PiecesOf = [&](const PunnedAccess &A) {
+        auto First = find_if(Pieces, [&](const PunnedPiece &P) { return P.Begin == A.Begin; });
+        auto Last = First;
+        while(Last != Pieces.end() && Last->End <= std::min(A.End, Size))
+            ++Last;
+        return make_range(First, Last);
+    };
+    auto IntOfPiece = [&](const PunnedPiece &P) {
+        return IntegerType::get(AI->getContext(), (P.End - P.Begin) * 8);
+    };
+
+    // A piece takes the type it is first accessed as, in program order
+    DenseMap<const BasicBlock *, unsigned> BlockOrder;
+    auto ComesBefore = [&](Instruction *A, Instruction *B) {
+        if(A->getParent() != B->getParent()) {
+            if(BlockOrder.empty()) {
+                unsigned N = 0;
+                for(auto &BB : *AI->getFunction())
+                    BlockOrder[&BB] = N++;
+            }
+            return BlockOrder[A->getParent()] < BlockOrder[B->getParent()];
+        }
+        for(auto *I = A->getNextNode(); I; I = I->getNextNode()) {
+            if(I == B)
+                return true;
+        }
+        return false;
+    };
+    SmallVector<Instruction *, 8> TypedBy(Pieces.size(), nullptr);
+    for(auto &Access : Accesses) {
+        if(Skipped(Access))
+            continue;
+        auto Range = PiecesOf(Access);
+        bool Unit = std::next(Range.begin()) == Range.end() && Access.End <= Size;
+        if(Unit && Access.Ty) {
+            unsigned Index = Range.begin() - Pieces.begin();
+            if(!TypedBy[Index] || ComesBefore(Access.I, TypedBy[Index])) {
+                TypedBy[Index] = Access.I;
+                Pieces[Index].Ty = Access.Ty;
+            }
+        }
+    }
+    for(auto &P : Pieces) {
+        if(!P.Ty)
+            P.Ty = IntOfPiece(P);
+    }
+
+    // Accesses which span several pieces must be copies or integers whose
+    // pieces can be bitcast to and from integers. Memsets need a bit pattern
+    // every piece can take.
+    bool Gain = Pieces.size() > 1 || Pieces[0].Ty != AI->getAllocatedType();
+    for(auto &Access : Accesses) {
+        if(Skipped(Access))
+            continue;
+        auto Range = PiecesOf(Access);
+        bool Unit = std::next(Range.begin()) == Range.end() && Access.End <= Size;
+        if(auto *MSI = dyn_cast<MemSetInst>(Access.I)) {
+            bool Zero = cast<ConstantInt>(MSI->getValue())->isZero();
+            for(auto &P : Range) {
+                if(!Zero && !CastInst::isBitCastable(IntOfPiece(P), P.Ty))
+                    return false;
+            }
+            Gain = true;
+            continue;
+        }
+        if(isa<MemTransferInst>(Access.I)) {
+            Gain = true;
+            continue;
+        }
+        if(Unit) {
+            Gain |= Access.Ty != Range.begin()->Ty
+                    && CastInst::isBitCastable(Access.Ty, Range.begin()->Ty);
+            continue;
+        }
+        Gain = true;
+        if(getCopiedInLoad(Access, Derived) || getCopiedOutStore(Access, Derived))
+            continue;
+        if(!isSplittableInt(Access.Ty))
+            return false;
+        for(auto &P : Range) {
+            if(!CastInst::isBitCastable(IntOfPiece(P), P.Ty))
+                return false;
+        }
+    }
+    // Nothing to gain from an alloca which stays the same, with the same
+    // accesses through casts of its address
+    if(!Gain)
+        return false;
+
+    NumPunned++;
+    unsigned AddrSpace = AI->getType()->getAddressSpace();
+    unsigned Align = AI->getAlignment() ? AI->getAlignment()
+                                        : DL.getABITypeAlignment(AI->getAllocatedType());
+    for(auto &P : Pieces) {
+        P.Alloca = new AllocaInst(P.Ty, AddrSpace, AI->getName() + "." + Twine(P.Begin), AI);
+        P.Alloca->setAlignment(std::max<unsigned>(MinAlign(Align, P.Begin),
+                                                  DL.getABITypeAlignment(P.Ty)));
+        NewAllocas.push_back(P.Alloca);
+    }
+    auto PiecePointer = [&](PunnedPiece &P, Type *Ty) -> Value * {
+        if(Ty == P.Ty)
+            return P.Alloca;
+        auto &Cast = P.Casts[Ty];
+        if(!Cast)
+            Cast = new BitCastInst(P.Alloca, PointerType::get(Ty, AddrSpace), "",
+                                   P.Alloca->getNextNode());
+        return Cast;
+    };
+    auto LoadFromPiece = [&](IRBuilder<> &B, PunnedPiece &P, Type *Ty) -> Value * {
+        unsigned PieceAlign = P.Alloca->getAlignment();
+        if(Ty != P.Ty && CastInst::isBitCastable(P.Ty, Ty))
+            return B.CreateBitCast(B.CreateAlignedLoad(P.Ty, P.Alloca, PieceAlign), Ty);
+        return B.CreateAlignedLoad(Ty, PiecePointer(P, Ty), PieceAlign);
+    };
+    auto StoreToPiece = [&](IRBuilder<> &B, PunnedPiece &P, Value *V) {
+        unsigned PieceAlign = P.Alloca->getAlignment();
+        Type *Ty = V->getType();
+        if(Ty != P.Ty && CastInst::isBitCastable(Ty, P.Ty))
+            B.CreateAlignedStore(B.CreateBitCast(V, P.Ty), P.Alloca, PieceAlign);
+        else
+            B.CreateAlignedStore(V, PiecePointer(P, Ty), PieceAlign);
+    };
+    // Pieces are copied as integers where their type allows it
+    auto CopyType = [&](PunnedPiece &P) -> Type * {
+        Type *IntTy = IntOfPiece(P);
+        return CastInst::isBitCastable(IntTy, P.Ty) ? IntTy : P.Ty;
+    };
+    auto AlignOf = [&](unsigned A, Type *Ty, uint64_t Offset) -> unsigned {
+        return MinAlign(A ? A : DL.getABITypeAlignment(Ty), Offset);
+    };
+
+    SmallSetVector<Instruction *, 8> Dead;
+    for(auto &Access : Accesses) {
+        Instruction *I = Access.I;
+        Dead.insert(I);
+        Budget.Rewrites++;
+        if(Skipped(Access))
+            continue;
+        auto Range = PiecesOf(Access);
+        bool Unit = std::next(Range.begin()) == Range.end() && Access.End <= Size;
+        IRBuilder<> B(I);
+
+        if(auto *MSI = dyn_cast<MemSetInst>(I)) {
+            uint8_t Byte = cast<ConstantInt>(MSI->getValue())->getZExtValue();
+            for(auto &P : Range) {
+                IntegerType *IntTy = IntOfPiece(P);
+                Constant *C = Byte ? ConstantExpr::getBitCast(
+                                         ConstantInt::get(IntTy, APInt::getSplat(IntTy->getBitWidth(),
+                                                                                 APInt(8, Byte))), P.Ty)
+                                   : Constant::getNullValue(P.Ty);
+                StoreToPiece(B, P, C);
+            }
+            continue;
+        }
+        if(auto *MTI = dyn_cast<MemTransferInst>(I)) {
+            bool Into = Derived.count(MTI->getRawDest());
+            Value *Other = Into ? MTI->getRawSource() : MTI->getRawDest();
+            unsigned OtherAlign = Into ? MTI->getSourceAlignment() : MTI->getDestAlignment();
+            for(auto &P : Range) {
+                uint64_t Rel = P.Begin - Access.Begin;
+                Type *Ty = CopyType(P);
+                Value *Ptr = GetBytePointer(B, Other, Rel, Ty);
+                if(Into)
+                    StoreToPiece(B, P, B.CreateAlignedLoad(Ty, Ptr, AlignOf(OtherAlign, Ty, Rel)));
+                else
+                    B.CreateAlignedStore(LoadFromPiece(B, P, Ty), Ptr, AlignOf(OtherAlign, Ty, Rel));
+            }
+            continue;
+        }
+
+        if(auto *LI = dyn_cast<LoadInst>(I)) {
+            if(Unit) {
+                LI->replaceAllUsesWith(LoadFromPiece(B, *Range.begin(), LI->getType()));
+                continue;
+            }
+            if(auto *SI = getCopiedOutStore(Access, Derived)) {
+                IRBuilder<> BS(SI);
+                Value *Dst = SI->getPointerOperand();
+                for(auto &P : Range) {
+                    uint64_t Rel = P.Begin - Access.Begin;
+                    Type *Ty = CopyType(P);
+                    BS.CreateAlignedStore(LoadFromPiece(B, P, Ty), GetBytePointer(BS, Dst, Rel, Ty),
+                                          AlignOf(SI->getAlignment(), LI->getType(), Rel));
+                }
+                Dead.remove(LI);
+                Dead.insert(SI);
+                Dead.insert(LI);
+                continue;
+            }
+            Value *Word = ConstantInt::get(Access.Ty, 0);
+            for(auto &P : Range) {
+                uint64_t Shift = DL.isLittleEndian() ? P.Begin - Access.Begin : Access.End - P.End;
+                Value *Bits = B.CreateZExt(LoadFromPiece(B, P, IntOfPiece(P)), Access.Ty);
+                Word = B.CreateOr(Word, Shift ? B.CreateShl(Bits, Shift * 8) : Bits);
+            }
+            LI->replaceAllUsesWith(Word);
+            continue;
+        }
+
+        auto *SI = cast<StoreInst>(I);
+        Value *V = SI->getValueOperand();
+        if(Access.Elem >= 0)
+            V = B.CreateExtractValue(V, unsigned(Access.Elem));
+        if(Unit) {
+            StoreToPiece(B, *Range.begin(), V);
+            continue;
+        }
+        if(auto *LI = getCopiedInLoad(Access, Derived)) {
+            IRBuilder<> BL(LI);
+            Value *Src = LI->getPointerOperand();
+            for(auto &P : Range) {
+                uint64_t Rel = P.Begin - Access.Begin;
+                Type *Ty = CopyType(P);
+                StoreToPiece(B, P, BL.CreateAlignedLoad(Ty, GetBytePointer(BL, Src, Rel, Ty),
+                                                        AlignOf(LI->getAlignment(), LI->getType(), Rel)));
+            }
+            Dead.insert(LI);
+            continue;
+        }
+        for(auto &P : Range) {
+            uint64_t Shift = DL.isLittleEndian() ? P.Begin - Access.Begin : Access.End - P.End;
+            Value *Bits = Shift ? B.CreateLShr(V, Shift * 8) : V;
+            StoreToPiece(B, P, B.CreateTrunc(Bits, IntOfPiece(P)));
+        }
+    }
+
+    // Everything that used the old alloca goes, users first
+    for(auto *I : Dead)
+        I->eraseFromParent();
+    for(auto *I : Markers)
+        I->eraseFromParent();
+    for(auto *I : reverse(Pointers))
+        I->eraseFromParent();
+    AI->eraseFromParent();
+    return true;
+}
+
+// A piece of an alloca that is accessed within a loop, either the whole alloca
+// or a field reached through a constant GEP.
+struct LoopSlot {
+    uint64_t Offset;
+    Type *Ty;
+    GetElementPtrInst *GEP = nullptr;
+    SmallVector<Instruction *, 4> Accesses;
+};
+
+// Checks whether the loop only accesses the alloca through plain loads and
+// stores of non-overlapping slots, and whether the alloca can have escaped by
+// the time control reaches the loop header. Slots to promote are collected.
+static bool isPromotableInLoop(AllocaInst *AI, Loop *L,
+                               std::map<std::pair<uint64_t, Type *>, LoopSlot> &Slots) {
+    if(!L->getLoopPreheader() || !L->hasDedicatedExits())
+        return false;
+    SmallVector<BasicBlock *, 4> ExitBlocks;
+    L->getUniqueExitBlocks(ExitBlocks);
+    for(auto *BB : ExitBlocks) {
+        if(BB->isEHPad())
+            return false;
+    }
+
+    const DataLayout &DL = AI->getModule()->getDataLayout();
+    auto *Header = L->getHeader();
+
+    // Lifetime markers and plain memory intrinsics, such as the memset of a
+    // zero initialized struct, do not capture the pointer. They only matter
+    // if they sit inside the loop.
+    auto IsOutsideAccess = [&](Instruction *I) {
+        if(L->contains(I))
+            return false;
+        if(auto *MI = dyn_cast<MemIntrinsic>(I))
+            return !MI->isVolatile();
+        auto *II = dyn_cast<IntrinsicInst>(I);
+        return II && II->isLifetimeStartOrEnd();
+    };
+
+    // Escaping uses are fine as long as they cannot reach the loop.
+    auto CanEscapeIntoLoop = [&](Instruction *I) {
+        return L->contains(I) || isPotentiallyReachable(I->getParent(), Header);
+    };
+
+    // Loads and stores which use the pointer as address only.
+    auto AddAccess = [&](Instruction *I, Value *Ptr, uint64_t Offset,
+                         Type *SlotTy, GetElementPtrInst *GEP) {
+        Type *AccessTy;
+        if(auto *LI = dyn_cast<LoadInst>(I)) {
+            if(LI->isVolatile())
+                return false;
+            AccessTy = LI->getType();
+        } else {
+            auto *SI = cast<StoreInst>(I);
+            if(SI->isVolatile() || SI->getValueOperand() == Ptr)
+                return false;
+            AccessTy = SI->getValueOperand()->getType();
+        }
+        if(AccessTy != SlotTy || !SlotTy->isSingleValueType())
+            return false;
+        auto &Slot = Slots[std::make_pair(Offset, SlotTy)];
+        Slot.Offset = Offset;
+        Slot.Ty = SlotTy;
+        if(!Slot.GEP)
+            Slot.GEP = GEP;
+        Slot.Accesses.push_back(I);
+        return true;
+    };
+
+    for(auto *U : AI->users()) {
+        auto *UI = cast<Instruction>(U);
+        if(isa<LoadInst>(UI) || (isa<StoreInst>(UI)
+                && cast<StoreInst>(UI)->getValueOperand() != AI)) {
+            if(L->contains(UI)
+                && !AddAccess(UI, AI, 0, AI->getAllocatedType(), nullptr))
+                return false;
+            continue;
+        }
+        auto *GEP = dyn_cast<GetElementPtrInst>(UI);
+        if(GEP && GEP->getPointerOperand() == AI && GEP->hasAllConstantIndices()) {
+            APInt Offset(DL.getIndexTypeSizeInBits(GEP->getType()), 0);
+            if(!GEP->accumulateConstantOffset(DL, Offset))
+                return false;
+            for(auto *GU : GEP->users()) {
+                auto *GUI = cast<Instruction>(GU);
+                if(isa<LoadInst>(GUI) || (isa<StoreInst>(GUI)
+                        && cast<StoreInst>(GUI)->getValueOperand() != GEP)) {
+                    if(L->contains(GUI) && !AddAccess(GUI, GEP, Offset.getZExtValue(),
+                                                      GEP->getResultElementType(), GEP))
+                        return false;
+                    continue;
+                }
+                if(!IsOutsideAccess(GUI) && CanEscapeIntoLoop(GUI))
+                    return false;
+            }
+            continue;
+        }
+        if(IsOutsideAccess(UI))
+            continue;
+        if(isa<BitCastInst>(UI) && !L->contains(UI)
+            && all_of(UI->users(), [&](User *BU) { return IsOutsideAccess(cast<Instruction>(BU)); }))
+            continue;
+        if(CanEscapeIntoLoop(UI))
+            return false;
+    }
+    if(Slots.empty())
+        return false;
+
+    // Slots are ordered by offset. They must not overlap each other.
+    uint64_t End = 0;
+    for(auto &Entry : Slots) {
+        if(Entry.second.Offset < End)
+            return false;
+        End = Entry.second.Offset + DL.getTypeStoreSize(Entry.second.Ty);
+    }
+    return true;
+}
+
+// Gets a pointer to the slot in the original alloca right before the given
+// instruction.
+static Value *GetSlotPointer(AllocaInst *AI, LoopSlot &Slot, Instruction *InsertPt) {
+    if(!Slot.GEP)
+        return AI;
+    auto *GEP = Slot.GEP->clone();
+    GEP->insertBefore(InsertPt);
+    return GEP;
+}
+
+// Rewrites the slots of an alloca within the loop to use fresh allocas which
+// are loaded once in the preheader and stored back at the exits.
+static void PromoteAllocaInLoop(AllocaInst *AI, Loop *L,
+                                std::map<std::pair<uint64_t, Type *>, LoopSlot> &Slots,
+                                std::vector<AllocaInst *> &AllocaList, WorkBudget &Budget) {
+    auto *PreheaderTerm = L->getLoopPreheader()->getTerminator();
+    SmallVector<BasicBlock *, 4> ExitBlocks;
+    L->getUniqueExitBlocks(ExitBlocks);
+    for(auto &Entry : Slots) {
+        auto &Slot = Entry.second;
+        auto *LoopAlloca = new AllocaInst(Slot.Ty, AI->getType()->getAddressSpace(),
+                                          AI->getName() + ".loop", AI);
+        NumLoopPromoted++;
+
+        // Load once in the preheader
+        auto *Ptr = GetSlotPointer(AI, Slot, PreheaderTerm);
+        auto *Init = new LoadInst(Slot.Ty, Ptr, AI->getName() + ".pre", PreheaderTerm);
+        new StoreInst(Init, LoopAlloca, PreheaderTerm);
+
+        // Store back at the exits
+        for(auto *BB : ExitBlocks) {
+            auto *InsertPt = &*BB->getFirstInsertionPt();
+            auto *Final = new LoadInst(Slot.Ty, LoopAlloca, "", InsertPt);
+            new StoreInst(Final, GetSlotPointer(AI, Slot, InsertPt), InsertPt);
+        }
+
+        Budget.Rewrites += Slot.Accesses.size();
+        for(auto *I : Slot.Accesses) {
+            if(auto *LI = dyn_cast<LoadInst>(I))
+                LI->setOperand(LI->getPointerOperandIndex(), LoopAlloca);
+            else
+                cast<StoreInst>(I)->setOperand(StoreInst::getPointerOperandIndex(), LoopAlloca);
+        }
+        AllocaList.push_back(LoopAlloca);
+    }
+
+    // Address computations inside the loop may be dead now.
+    for(auto &Entry : Slots) {
+        auto *GEP = Entry.second.GEP;
+        if(GEP && GEP->use_empty())
+            GEP->eraseFromParent();
+    }
+}
+
+// Tries to promote the alloca within the outermost loops where it is legal.
+// The allocas that can be handed over to Mem2Reg are added to the list.
+static bool PromoteAllocaInLoops(AllocaInst *AI, ArrayRef<Loop *> Loops,
+                                 std::vector<AllocaInst *> &AllocaList, WorkBudget &Budget) {
+    bool Changed = false;
+    for(auto *L : Loops) {
+        std::map<std::pair<uint64_t, Type *>, LoopSlot> Slots;
+        if(isPromotableInLoop(AI, L, Slots)) {
+            PromoteAllocaInLoop(AI, L, Slots, AllocaList, Budget);
+            Changed = true;
+            continue;
+        }
+        Changed |= PromoteAllocaInLoops(AI, L->getSubLoops(), AllocaList, Budget);
+    }
+    return Changed;
+}
+
+// A load or a store at a constant offset within an alloca.
+struct SlotAccess {
+    uint64_t Offset;
+    uint64_t Size;
+    Type *Ty;
+    Value *Val;     // Value stored, or the load itself
+    Instruction *I;
+};
+
+static bool Overlaps(const SlotAccess &A, const SlotAccess &B) {
+    return A.Offset < B.Offset + B.Size && B.Offset < A.Offset + A.Size;
+}
+
+static bool SameSlot(const SlotAccess &A, const SlotAccess &B) {
+    return A.Offset == B.Offset && A.Ty == B.Ty;
+}
+
+// Collects the loads and stores at constant offsets within the alloca, along
+// with every pointer derived from it. Returns true if the alloca is accessed
+// in no other way.
+static bool CollectSlotAccesses(AllocaInst *AI, DenseMap<Instruction *, SlotAccess> &Accesses,
+                                SmallPtrSetImpl<Value *> &Derived) {
+    const DataLayout &DL = AI->getModule()->getDataLayout();
+    auto AddAccess = [&](Instruction *I, Value *Ptr, uint64_t Offset) {
+        if(auto *LI = dyn_cast<LoadInst>(I)) {
+            if(!LI->isSimple())
+                return false;
+            Accesses[I] = {Offset, DL.getTypeStoreSize(LI->getType()), LI->getType(), LI, I};
+            return true;
+        }
+        if(auto *SI = dyn_cast<StoreInst>(I)) {
+            auto *Val = SI->getValueOperand();
+            if(!SI->isSimple() || Val == Ptr)
+                return false;
+            Accesses[I] = {Offset, DL.getTypeStoreSize(Val->getType()), Val->getType(), Val, I};
+            return true;
+        }
+        return false;
+    };
+
+    // Every pointer based on the alloca
+    SmallVector<Value *, 8> Worklist;
+    Worklist.push_back(AI);
+    Derived.insert(AI);
+    while(!Worklist.empty()) {
+        for(auto *U : Worklist.pop_back_val()->users()) {
+            if((isa<BitCastInst>(U) || isa<GetElementPtrInst>(U) || isa<AddrSpaceCastInst>(U)
+                || isa<PHINode>(U) || isa<SelectInst>(U)) && Derived.insert(U).second)
+                Worklist.push_back(U);
+        }
+    }
+
+    bool AllKnown = true;
+    for(auto *U : AI->users()) {
+        auto *UI = cast<Instruction>(U);
+        if(AddAccess(UI, AI, 0) || isLifetimeMarker(UI))
+            continue;
+        auto *GEP = dyn_cast<GetElementPtrInst>(UI);
+        if(GEP && GEP->getPointerOperand() == AI && GEP->hasAllConstantIndices()) {
+            APInt Offset(DL.getIndexTypeSizeInBits(GEP->getType()), 0);
+            if(GEP->accumulateConstantOffset(DL, Offset) && !Offset.isNegative()) {
+                for(auto *GU : GEP->users()) {
+                    if(!AddAccess(cast<Instruction>(GU), GEP, Offset.getZExtValue())
+                        && !isLifetimeMarker(GU))
+                        AllKnown = false;
+                }
+                continue;
+            }
+        }
+        if((isa<BitCastInst>(UI) || isa<GetElementPtrInst>(UI)) && onlyUsedByLifetimeMarkers(UI))
+            continue;
+        AllKnown = false;
+    }
+    return AllKnown;
+}
+
+// Collects the instructions at which the address of an alloca escapes.
+struct CaptureCollector : public CaptureTracker {
+    SmallPtrSet<Instruction *, 4> Captures;
+    bool Everywhere = false;
+
+    void tooManyUses() override { Everywhere = true; }
+
+    bool captured(const Use *U) override {
+        Captures.insert(cast<Instruction>(U->getUser()));
+        return false;
+    }
+};
+
+// Forwards stores to later loads of the same slot within a block and removes
+// stores that are overwritten before being read. Any instruction which may
+// access the alloca in some other way ends the region. If the alloca is only
+// accessed through its slots, stores that are never read at all are removed.
+static bool ForwardSlotAccesses(AllocaInst *AI, WorkBudget &Budget) {
+    DenseMap<Instruction *, SlotAccess> Accesses;
+    SmallPtrSet<Value *, 8> Derived;
+    bool AllKnown = CollectSlotAccesses(AI, Accesses, Derived);
+    if(Accesses.empty())
+        return false;
+
+    // Where the alloca escapes is worked out once, not per instruction
+    CaptureCollector Collector;
+    PointerMayBeCaptured(AI, &Collector);
+    SmallVector<BasicBlock *, 8> CaptureSuccs;
+    for(auto *I : Collector.Captures)
+        CaptureSuccs.append(succ_begin(I->getParent()), succ_end(I->getParent()));
+
+    // A block may be entered after the alloca escaped if it is reachable from
+    // a block where it escapes. The search gives up, and assumes so, past a
+    // few dozen blocks.
+    auto EnteredCaptured = [&](BasicBlock *BB) {
+        if(Collector.Everywhere)
+            return true;
+        if(CaptureSuccs.empty())
+            return false;
+        SmallVector<BasicBlock *, 8> Worklist(CaptureSuccs.begin(), CaptureSuccs.end());
+        return isPotentiallyReachableFromMany(Worklist, BB);
+    };
+
+    // Nothing carries over between blocks, so only the blocks which access
+    // the alloca are scanned, not the whole function.
+    SmallSetVector<BasicBlock *, 8> Blocks;
+    for(auto &Entry : Accesses)
+        Blocks.insert(Entry.first->getParent());
+
+    SmallSetVector<Instruction *, 8> Dead;
+    for(auto *BB : Blocks) {
+        SmallVector<SlotAccess, 4> Available;   // Values known to be in slots
+        SmallVector<SlotAccess, 4> Pending;     // Stores not read yet
+        bool Captured = EnteredCaptured(BB);
+        for(auto &I : *BB) {
+            if(Collector.Captures.count(&I))
+                Captured = true;
+            auto It = Accesses.find(&I);
+            if(It != Accesses.end()) {
+                auto &Access = It->second;
+                auto IsSame = [&](const SlotAccess &A) { return SameSlot(A, Access); };
+                auto IsOverlapping = [&](const SlotAccess &A) { return Overlaps(A, Access); };
+                if(isa<LoadInst>(I)) {
+                    erase_if(Pending, IsOverlapping);
+                    auto Avail = find_if(Available, IsSame);
+                    if(Avail != Available.end()) {
+                        I.replaceAllUsesWith(Avail->Val);
+                        Dead.insert(&I);
+                        NumForwarded++;
+                        continue;
+                    }
+                    Available.push_back(Access);
+                    continue;
+                }
+                Access.Val = cast<StoreInst>(I).getValueOperand();
+                auto Prev = find_if(Pending, IsSame);
+                if(Prev != Pending.end()) {
+                    Dead.insert(Prev->I);
+                    NumDeadStores++;
+                }
+                erase_if(Pending, IsOverlapping);
+                erase_if(Available, IsOverlapping);
+                Available.push_back(Access);
+                Pending.push_back(Access);
+                continue;
+            }
+
+            // See if this could touch the alloca behind our back
+            if(!I.mayReadOrWriteMemory())
+                continue;
+            bool UsesAlloca = any_of(I.operands(), [&](Value *V) { return Derived.count(V); });
+            if(!UsesAlloca && !Captured)
+                continue;
+            if(UsesAlloca || I.mayReadFromMemory())
+                Pending.clear();
+            if(UsesAlloca || I.mayWriteToMemory())
+                Available.clear();
+        }
+    }
+
+    // Stores to slots that are never read anywhere are dead.
+    if(AllKnown) {
+        for(auto &Entry : Accesses) {
+            auto &Store = Entry.second;
+            if(!isa<StoreInst>(Store.I) || Dead.count(Store.I))
+                continue;
+            bool Read = any_of(Accesses, [&](const std::pair<Instruction *, SlotAccess> &Other) {
+                return isa<LoadInst>(Other.first) && !Dead.count(Other.first)
+                       && Overlaps(Other.second, Store);
+            });
+            if(!Read) {
+                Dead.insert(Store.I);
+                NumDeadStores++;
+            }
+        }
+    }
+
+    Budget.Rewrites += Dead.size();
+    for(auto *I : Dead) {
+        auto *GEP = dyn_cast<GetElementPtrInst>(getLoadStorePointerOperand(I));
+        I->eraseFromParent();
+        if(GEP && GEP->use_empty())
+            GEP->eraseFromParent();
+    }
+    return !Dead.empty();
+}
+
+// A run of bits within packed integer storage which is read and written on
+// its own.
+struct BitField {
+    unsigned Lo;
+    unsigned Width;
+    AllocaInst *Alloca = nullptr;
+};
+
+// Store of a value into one bitfield, i.e. store ((load & ~Mask) | Val).
+struct BitFieldWrite {
+    StoreInst *SI;
+    Value *Val;
+    unsigned Field;
+};
+
+// Load followed by a shift and mask which extracts one bitfield.
+struct BitFieldRead {
+    LoadInst *LI;
+    Instruction *Head;
+    Instruction *Result;
+    unsigned Field;
+    bool Signed;
+};
+
+// Matches the shifts and masks extracting a bitfield from a loaded word.
+static Instruction *MatchBitFieldRead(LoadInst *LI, Instruction *I, unsigned &Lo,
+                                      unsigned &Width, bool &Signed) {
+    unsigned W = LI->getType()->getIntegerBitWidth();
+    const APInt *Sh, *Sh2, *M;
+    Instruction *Result = nullptr;
+    Signed = false;
+    if(match(I, m_LShr(m_Specific(LI), m_APInt(Sh))) && Sh->ult(W)) {
+        Lo = Sh->getZExtValue();
+        Width = W - Lo;
+        Result = I;
+        auto *Next = I->hasOneUse() ? cast<Instruction>(*I->user_begin()) : nullptr;
+        if(Next && match(Next, m_And(m_Specific(I), m_APInt(M)))
+            && M->isMask() && M->countTrailingOnes() < Width) {
+            Width = M->countTrailingOnes();
+            Result = Next;
+        }
+    } else if(match(I, m_AShr(m_Specific(LI), m_APInt(Sh))) && Sh->ult(W)) {
+        Lo = Sh->getZExtValue();
+        Width = W - Lo;
+        Signed = true;
+        Result = I;
+    } else if(match(I, m_And(m_Specific(LI), m_APInt(M))) && M->isMask()) {
+        Lo = 0;
+        Width = M->countTrailingOnes();
+        Result = I;
+    } else if(match(I, m_Shl(m_Specific(LI), m_APInt(Sh))) && Sh->ult(W) && I->hasOneUse()) {
+        auto *Next = cast<Instruction>(*I->user_begin());
+        Signed = match(Next, m_AShr(m_Specific(I), m_APInt(Sh2)));
+        if((Signed || match(Next, m_LShr(m_Specific(I), m_APInt(Sh2))))
+            && Sh2->ult(W) && Sh2->uge(*Sh)) {
+            Width = W - Sh2->getZExtValue();
+            Lo = Sh2->getZExtValue() - Sh->getZExtValue();
+            Result = Next;
+        }
+    }
+    // Reading the whole word is not reading a field
+    if(Result && (Width == 0 || Width == W))
+        return nullptr;
+    return Result;
+}
+
+// Splits bitfields packed into an integer alloca into allocas of their own,
+// so that Mem2Reg turns every field into an independent value instead of a
+// read-modify-write of the whole word. The packed word is rebuilt only where
+// it is observed as a whole. The fields are added to the promotion list.
+static bool SplitBitfieldAlloca(AllocaInst *AI, std::vector<AllocaInst *> &AllocaList,
+                                WorkBudget &Budget) {
+    const DataLayout &DL = AI->getModule()->getDataLayout();
+    IntegerType *WordTy = nullptr;
+    SmallVector<LoadInst *, 8> Loads;
+    SmallVector<StoreInst *, 8> Stores;
+    auto AddAccess = [&](User *U, Value *Ptr) {
+        Type *Ty;
+        if(auto *LI = dyn_cast<LoadInst>(U)) {
+            if(LI->isVolatile())
+                return false;
+            Ty = LI->getType();
+            Loads.push_back(LI);
+        } else if(auto *SI = dyn_cast<StoreInst>(U)) {
+            if(SI->isVolatile() || SI->getValueOperand() == Ptr)
+                return false;
+            Ty = SI->getValueOperand()->getType();
+            Stores.push_back(SI);
+        } else {
+            return false;
+        }
+        auto *IntTy = dyn_cast<IntegerType>(Ty);
+        if(!IntTy || (WordTy && IntTy != WordTy))
+            return false;
+        WordTy = IntTy;
+        return true;
+    };
+
+    // The word may be accessed directly or through a bitcast of the storage.
+    for(auto *U : AI->users()) {
+        if(AddAccess(U, AI) || isLifetimeMarker(U))
+            continue;
+        if(auto *BCI = dyn_cast<BitCastInst>(U)) {
+            for(auto *BU : BCI->users()) {
+                if(!AddAccess(BU, BCI) && !isLifetimeMarker(BU))
+                    return false;
+            }
+            continue;
+        }
+        return false;
+    }
+    // All accesses are at offset 0. The word may be narrower than the storage,
+    // as in clang's { iN, [k x i8] } layout; the bytes past it are padding and
+    // are left alone.
+    if(!WordTy || DL.getTypeSizeInBits(WordTy) != DL.getTypeStoreSizeInBits(WordTy)
+        || DL.getTypeStoreSize(WordTy) > DL.getTypeAllocSize(AI->getAllocatedType()))
+        return false;
+
+    unsigned W = WordTy->getBitWidth();
+    SmallVector<BitField, 4> Fields;
+    auto AddField = [&](unsigned Lo, unsigned Width, unsigned &Index) {
+        for(unsigned i = 0; i < Fields.size(); ++i) {
+            if(Fields[i].Lo == Lo && Fields[i].Width == Width) {
+                Index = i;
+                return true;
+            }
+            if(Lo < Fields[i].Lo + Fields[i].Width && Fields[i].Lo < Lo + Width)
+                return false;
+        }
+        Index = Fields.size();
+        Fields.push_back({Lo, Width});
+        return true;
+    };
+
+    // Stores of a single field, with nothing else written to the word
+    // between the load and the store.
+    SmallVector<BitFieldWrite, 4> Writes;
+    SmallPtrSet<Value *, 8> Clears;
+    for(auto *SI : Stores) {
+        Value *Ld, *V;
+        const APInt *C;
+        auto *Or = dyn_cast<Instruction>(SI->getValueOperand());
+        if(!Or || !Or->hasOneUse()
+            || !match(Or, m_c_Or(m_And(m_Value(Ld), m_APInt(C)), m_Value(V))))
+            continue;
+        auto *Clear = cast<Instruction>(Or->getOperand(0) == V ? Or->getOperand(1)
+                                                                : Or->getOperand(0));
+        auto *LI = dyn_cast<LoadInst>(Ld);
+        APInt Mask = ~*C;
+        if(!LI || !is_contained(Loads, LI) || !Clear->hasOneUse()
+            || LI->getParent() != SI->getParent() || !Mask.isShiftedMask()
+            || !MaskedValueIsZero(V, *C, DL))
+            continue;
+        bool Clobbered = false;
+        for(auto *I = LI->getNextNode(); I != SI; I = I->getNextNode())
+            Clobbered |= isa<StoreInst>(I) && is_contained(Stores, cast<StoreInst>(I));
+        if(Clobbered)
+            continue;
+        unsigned Field;
+        if(!AddField(Mask.countTrailingZeros(), Mask.countPopulation(), Field))
+            return false;
+        Writes.push_back({SI, V, Field});
+        Clears.insert(Clear);
+    }
+
+    // Loads that only extract a single field
+    SmallVector<BitFieldRead, 4> Reads;
+    for(auto *LI : Loads) {
+        for(auto *U : LI->users()) {
+            if(Clears.count(U))
+                continue;
+            auto *I = cast<Instruction>(U);
+            unsigned Lo, Width, Field;
+            bool Signed;
+            if(auto *Result = MatchBitFieldRead(LI, I, Lo, Width, Signed)) {
+                if(!AddField(Lo, Width, Field))
+                    return false;
+                Reads.push_back({LI, I, Result, Field, Signed});
+            }
+        }
+    }
+    if(Fields.empty())
+        return false;
+
+    Budget.Rewrites += Loads.size() + Stores.size();
+    LLVMContext &Ctx = AI->getContext();
+    APInt FieldsMask(W, 0);
+    for(auto &Field : Fields) {
+        Field.Alloca = new AllocaInst(IntegerType::get(Ctx, Field.Width),
+                                      AI->getType()->getAddressSpace(),
+                                      AI->getName() + ".bf", AI);
+        FieldsMask.setBits(Field.Lo, Field.Lo + Field.Width);
+        AllocaList.push_back(Field.Alloca);
+        NumBitfields++;
+    }
+    auto GetFieldBits = [&](IRBuilder<> &B, Value *Word, BitField &Field) {
+        Value *Bits = Field.Lo ? B.CreateLShr(Word, Field.Lo) : Word;
+        return B.CreateTrunc(Bits, Field.Alloca->getAllocatedType());
+    };
+
+    // The storage keeps every bit outside of the fields. The word is the
+    // storage with the fields put back in.
+    SmallVector<WeakTrackingVH, 8> MaybeDead;
+    SmallPtrSet<Instruction *, 8> Heads;
+    for(auto &Read : Reads) {
+        auto &Field = Fields[Read.Field];
+        IRBuilder<> B(Read.LI);
+        Value *Val = B.CreateLoad(Field.Alloca->getAllocatedType(), Field.Alloca);
+        Val = Read.Signed ? B.CreateSExt(Val, WordTy) : B.CreateZExt(Val, WordTy);
+        Read.Result->replaceAllUsesWith(Val);
+        MaybeDead.push_back(Read.Result);
+        Heads.insert(Read.Head);
+    }
+    for(auto *LI : Loads) {
+        SmallVector<Use *, 4> WordUses;
+        for(auto &U : LI->uses()) {
+            auto *I = cast<Instruction>(U.getUser());
+            if(!Clears.count(I) && !Heads.count(I))
+                WordUses.push_back(&U);
+        }
+        if(WordUses.empty()) {
+            MaybeDead.push_back(LI);
+            continue;
+        }
+        IRBuilder<> B(LI->getNextNode());
+        Value *Word = B.CreateAnd(LI, ~FieldsMask);
+        for(auto &Field : Fields) {
+            Value *Val = B.CreateLoad(Field.Alloca->getAllocatedType(), Field.Alloca);
+            Val = B.CreateZExt(Val, WordTy);
+            Word = B.CreateOr(Word, Field.Lo ? B.CreateShl(Val, Field.Lo) : Val);
+        }
+        for(auto *U : WordUses)
+            U->set(Word);
+    }
+    for(auto *SI : Stores) {
+        auto It = find_if(Writes, [&](const BitFieldWrite &Write) { return Write.SI == SI; });
+        IRBuilder<> B(SI);
+        if(It != Writes.end()) {
+            auto &Field = Fields[It->Field];
+            B.CreateStore(GetFieldBits(B, It->Val, Field), Field.Alloca);
+            MaybeDead.push_back(SI->getValueOperand());
+            SI->eraseFromParent();
+            continue;
+        }
+        for(auto &Field : Fields)
+            B.CreateStore(GetFieldBits(B, SI->getValueOperand(), Field), Field.Alloca);
+    }
+
+    // Clean up the shifts and masks, but leave the storage to the caller.
+    while(!MaybeDead.empty()) {
+        auto *I = dyn_cast_or_null<Instruction>(MaybeDead.pop_back_val());
+        if(!I || !(isa<BinaryOperator>(I) || isa<LoadInst>(I))
+            || !isInstructionTriviallyDead(I))
+            continue;
+        for(auto &Op : I->operands()) {
+            if(isa<Instruction>(Op))
+                MaybeDead.push_back(Op.get());
+        }
+        I->eraseFromParent();
+    }
+    return true;
+}
+
+// Structs with more fields than this stay arrays of structs
+static const unsigned MaxTransposedFields = 8;
+
+// Pointer to one field of one element of an array of structs. It is either
+// a GEP "0, %i, k" on the array, or a GEP "0, k" on a GEP "0, %i" on it.
+struct FieldAccess {
+    GetElementPtrInst *GEP;
+    Value *Index;
+    unsigned Field;
+    bool InBounds;
+};
+
+// Checks that a pointer to a field is only used to load and store the field.
+static bool isOnlyLoadedOrStored(const Instruction *FieldPtr) {
+    for(const auto *U : FieldPtr->users()) {
+        if(const auto *LI = dyn_cast<LoadInst>(U)) {
+            if(LI->isVolatile())
+                return false;
+            continue;
+        }
+        if(const auto *SI = dyn_cast<StoreInst>(U)) {
+            if(SI->getValueOperand() == FieldPtr || SI->isVolatile())
+                return false;
+            continue;
+        }
+        return false;
+    }
+    return true;
+}
+
+// Matches a GEP selecting a field of the struct its pointer operand points to.
+static bool isFieldGEP(const GetElementPtrInst *GEP, unsigned &Field) {
+    auto *FieldIdx = dyn_cast<ConstantInt>(GEP->getOperand(GEP->getNumOperands() - 1));
+    if(!FieldIdx || !match(GEP->getOperand(1), m_Zero()))
+        return false;
+    Field = FieldIdx->getZExtValue();
+    return isOnlyLoadedOrStored(GEP);
+}
+
+// Collects the field accesses of an array of structs. Fails unless every use
+// of the array goes through one, so the array does not escape. Instructions
+// which are left without a use once the accesses are rewritten go into Dead,
+// in the order they can be erased in.
+static bool CollectFieldAccesses(AllocaInst *AI, SmallVectorImpl<FieldAccess> &Accesses,
+                                 SmallVectorImpl<Instruction *> &Dead) {
+    for(auto *U : AI->users()) {
+        if(auto *BCI = dyn_cast<BitCastInst>(U)) {
+            if(!onlyUsedByLifetimeMarkers(BCI))
+                return false;
+            for(auto *Marker : BCI->users())
+                Dead.push_back(cast<Instruction>(Marker));
+            Dead.push_back(BCI);
+            continue;
+        }
+        auto *GEP = dyn_cast<GetElementPtrInst>(U);
+        if(!GEP || GEP->getPointerOperand() != AI || !match(GEP->getOperand(1), m_Zero()))
+            return false;
+
+        unsigned Field;
+        if(GEP->getNumIndices() == 3) {
+            if(!isFieldGEP(GEP, Field))
+                return false;
+            Accesses.push_back({GEP, GEP->getOperand(2), Field, GEP->isInBounds()});
+            continue;
+        }
+        if(GEP->getNumIndices() != 2)
+            return false;
+        for(auto *ElemUser : GEP->users()) {
+            auto *FieldGEP = dyn_cast<GetElementPtrInst>(ElemUser);
+            if(!FieldGEP || FieldGEP->getPointerOperand() != GEP
+            || FieldGEP->getNumIndices() != 2 || !isFieldGEP(FieldGEP, Field))
+                return false;
+            Accesses.push_back({FieldGEP, GEP->getOperand(2), Field,
+                                GEP->isInBounds() && FieldGEP->isInBounds()});
+        }
+        Dead.push_back(GEP);
+    }
+    return true;
+}
+
+// Replaces a local array of small structs with one array per field. Arrays
+// which are small and only indexed by constants are left alone, since they
+// are split into scalars anyway.
+static bool TransposeAlloca(AllocaInst *AI, SmallVectorImpl<AllocaInst *> &FieldAllocas,
+                            WorkBudget &Budget) {
+    auto *ArrTy = dyn_cast<ArrayType>(AI->getAllocatedType());
+    if(!ArrTy || AI->isArrayAllocation())
+        return false;
+    auto *ST = dyn_cast<StructType>(ArrTy->getElementType());
+    if(!ST || ST->isOpaque() || ST->getNumElements() > MaxTransposedFields)
+        return false;
+    for(auto *FieldTy : ST->elements()) {
+        if(!FieldTy->isSingleValueType())
+            return false;
+    }
+
+    SmallVector<FieldAccess, 8> Accesses;
+    SmallVector<Instruction *, 4> Dead;
+    if(!CollectFieldAccesses(AI, Accesses, Dead))
+        return false;
+    if(ArrTy->getNumElements() <= 5
+    && all_of(Accesses, [](const FieldAccess &A) { return isa<Constant>(A.Index); }))
+        return false;
+
+    // Only the fields which are used get an array. It is aligned like the
+    // original array, but the elements of a field array are closer together
+    // than those of the struct array, so accesses may promise only what
+    // holds for every element.
+    const DataLayout &DL = AI->getModule()->getDataLayout();
+    SmallVector<AllocaInst *, 8> Fields(ST->getNumElements(), nullptr);
+    Budget.Rewrites += Accesses.size();
+    for(auto &Access : Accesses) {
+        Type *FieldTy = ST->getElementType(Access.Field);
+        auto *&FieldAlloca = Fields[Access.Field];
+        if(!FieldAlloca) {
+            auto *FieldArrTy = ArrayType::get(FieldTy, ArrTy->getNumElements());
+            FieldAlloca = new AllocaInst(FieldArrTy, AI->getType()->getAddressSpace(),
+                                         AI->getName() + ".f" + Twine(Access.Field), AI);
+            FieldAlloca->setAlignment(AI->getAlignment());
+            FieldAllocas.push_back(FieldAlloca);
+        }
+        unsigned BaseAlign = AI->getAlignment() ? AI->getAlignment()
+                                                : DL.getABITypeAlignment(FieldTy);
+        unsigned ElemAlign = MinAlign(BaseAlign, DL.getTypeAllocSize(FieldTy));
+        for(auto *U : Access.GEP->users()) {
+            if(auto *LI = dyn_cast<LoadInst>(U)) {
+                if(LI->getAlignment() > ElemAlign)
+                    LI->setAlignment(ElemAlign);
+            } else {
+                auto *SI = cast<StoreInst>(U);
+                if(SI->getAlignment() > ElemAlign)
+                    SI->setAlignment(ElemAlign);
+            }
+        }
+        IRBuilder<> Builder(Access.GEP);
+        Value *Idx[] = { ConstantInt::get(Access.Index->getType(), 0), Access.Index };
+        Type *FieldArrTy = FieldAlloca->getAllocatedType();
+        Value *NewGEP = Access.InBounds
+                      ? Builder.CreateInBoundsGEP(FieldArrTy, FieldAlloca, Idx, Access.GEP->getName())
+                      : Builder.CreateGEP(FieldArrTy, FieldAlloca, Idx, Access.GEP->getName());
+        Access.GEP->replaceAllUsesWith(NewGEP);
+        Access.GEP->eraseFromParent();
+    }
+    for(auto *I : Dead)
+        I->eraseFromParent();
+    AI->eraseFromParent();
+    NumTransposed++;
+    return true;
+}
+
+// Finds the copy into an alloca which is the only write to it. Fails if the
+// alloca is written otherwise, is copied into only in part, or escapes.
+// Lifetime markers of the alloca go into Markers.
+static MemTransferInst *FindOnlyCopy(AllocaInst *AI, SmallVectorImpl<Instruction *> &Markers) {
+    MemTransferInst *Copy = nullptr;
+
+    // Pointers based on the alloca, and whether they point past its start
+    SmallVector<std::pair<Value *, bool>, 8> Worklist;
+    Worklist.push_back({AI, false});
+    while(!Worklist.empty()) {
+        Value *Ptr = Worklist.back().first;
+        bool IsOffset = Worklist.back().second;
+        Worklist.pop_back();
+        for(auto &U : Ptr->uses()) {
+            auto *I = cast<Instruction>(U.getUser());
+            if(auto *LI = dyn_cast<LoadInst>(I)) {
+                if(LI->isVolatile())
+                    return nullptr;
+                continue;
+            }
+            if(isa<BitCastInst>(I)) {
+                Worklist.push_back({I, IsOffset});
+                continue;
+            }
+            if(auto *GEP = dyn_cast<GetElementPtrInst>(I)) {
+                Worklist.push_back({I, IsOffset || !GEP->hasAllZeroIndices()});
+                continue;
+            }
+            if(isLifetimeMarker(I)) {
+                Markers.push_back(I);
+                continue;
+            }
+            if(auto *MTI = dyn_cast<MemTransferInst>(I)) {
+                if(MTI->isVolatile())
+                    return nullptr;
+
+                // Copying out of the alloca only reads it
+                if(U.getOperandNo() == 1)
+                    continue;
+                if(Copy || IsOffset || U.getOperandNo() != 0)
+                    return nullptr;
+                Copy = MTI;
+                continue;
+            }
+            return nullptr;
+        }
+    }
+    return Copy;
+}
+
+// Replaces an alloca whose only write is a full copy of a constant global
+// with the global. Loads before the copy read undef, so the global is a fine
+// stand-in for those as well.
+static bool ReplaceConstantCopy(AllocaInst *AI, const ScalarReplAggregatesOptions &Opts,
+                                WorkBudget &Budget) {
+    if(AI->isArrayAllocation())
+        return false;
+    SmallVector<Instruction *, 4> Markers;
+    auto *Copy = FindOnlyCopy(AI, Markers);
+    if(!Copy)
+        return false;
+    auto *GV = dyn_cast<GlobalVariable>(Copy->getSource());
+    if(!GV || !GV->isConstant() || !GV->hasDefinitiveInitializer()
+    || GV->getType()->getAddressSpace() != AI->getType()->getAddressSpace())
+        return false;
+
+    // The whole alloca has to come from the global, and accesses to the
+    // alloca must not assume more alignment than the global has.
+    const DataLayout &DL = AI->getModule()->getDataLayout();
+    auto *Len = dyn_cast<ConstantInt>(Copy->getLength());
+    if(!Len || Len->getZExtValue() < DL.getTypeAllocSize(AI->getAllocatedType())
+    || GV->getPointerAlignment(DL) < AI->getAlignment())
+        return false;
+
+    if(!Opts.Quiet)
+        errs() << "CONSTANT COPY: " << *AI << "\n";
+    Copy->eraseFromParent();
+    for(auto *Marker : Markers)
+        Marker->eraseFromParent();
+    Budget.Rewrites += AI->getNumUses();
+    AI->replaceAllUsesWith(ConstantExpr::getBitCast(GV, AI->getType()));
+    AI->eraseFromParent();
+    NumConstantCopies++;
+    return true;
+}
+
+// Collects the promises of the coroutines of a function which have not been
+// split yet. A promise is also reached through llvm.coro.promise, at a fixed
+// offset in the coroutine frame, so it has to stay whole and in memory.
+// Coroutine intrinsics take no other pointers to local memory.
+static void CollectCoroutinePromises(Function &F, SmallPtrSetImpl<AllocaInst *> &Promises) {
+    auto *CoroId = F.getParent()->getFunction(Intrinsic::getName(Intrinsic::coro_id));
+    if(!CoroId)
+        return;
+    for(auto *U : CoroId->users()) {
+        auto *II = dyn_cast<IntrinsicInst>(U);
+        if(!II || II->getFunction() != &F)
+            continue;
+        if(auto *AI = dyn_cast<AllocaInst>(II->getArgOperand(1)->stripPointerCasts()))
+            Promises.insert(AI);
+    }
+}
+
+// The dominator tree and loop info are only asked for when they are needed.
+static bool RunOnFunction(Function &F, const ScalarReplAggregatesOptions &Opts,
+                          function_ref<DominatorTree &()> GetDT, AssumptionCache &AC,
+                          function_ref<LoopInfo &()> GetLI) {
+    if(!Opts.Quiet)
+        errs() << "RUN ON FUNCTION:" << F.getName() << " \n";
+
+    // Get all allocas first, except for coroutine promises
+    SmallPtrSet<AllocaInst *, 2> Promises;
+    CollectCoroutinePromises(F, Promises);
+    SmallVector<AllocaInst *, 4> Worklist;
+    for(auto &I : F.getEntryBlock()) {
+        auto *AI = dyn_cast<AllocaInst>(&I);
+        if(AI && !Promises.count(AI))
+            Worklist.push_back(AI);
+    }
+
+    bool Changed = false;
+    for(auto *AI : Worklist)
+        Changed |= RewriteAddrSpaceCasts(AI);
+
+    // Every rewrite counts against the budget, whichever stage it is made by
+    WorkBudget Budget(Opts);
+
+    // Read-only copies of constant globals go away before anything else
+    if(Opts.ConstantCopies) {
+        SmallVector<AllocaInst *, 4> Allocas;
+        for(auto *AI : Worklist) {
+            if(!Budget.exhausted() && ReplaceConstantCopy(AI, Opts, Budget))
+                Changed = true;
+            else
+                Allocas.push_back(AI);
+        }
+        Worklist = Allocas;
+    }
+
+    // Arrays of structs get their field-major layout before splitting
+    if(Opts.StructOfArrays) {
+        SmallVector<AllocaInst *, 4> Allocas;
+        for(auto *AI : Worklist) {
+            if(!Budget.exhausted() && TransposeAlloca(AI, Allocas, Budget))
+                Changed = true;
+            else
+                Allocas.push_back(AI);
+        }
+        Worklist = Allocas;
+    }
+    SmallVector<AllocaInst *, 4> TempWorklist;
+    AddressHolders Holders;
+    bool OutOfBudget = false;
+    std::unique_ptr<ThreadPool> Pool;
+    do {
+        TimeTraceScope IterationScope("SROAIteration",
+                                      [&] { return TraceDetail(F, Worklist.size()); });
+        if(!Opts.Quiet) {
+            errs() << "PRINTING FUNCTION BEFORE ANALYSIS: \n";
+            F.print(errs());
+        }
+        SmallVector<AllocaInst *, 4> TryPromotelist;
+        if(Opts.AnalysisThreads > 1 && !Worklist.empty() && Worklist.size() >= Opts.AnalysisThreshold) {
+            if(!Pool)
+                Pool.reset(new ThreadPool(Opts.AnalysisThreads));
+            Changed |= AnalyzeAllocasConcurrently(Worklist, TempWorklist, TryPromotelist,
+                                                  Holders, Budget, Opts, *Pool);
+        }
+        while(!Worklist.empty() && !Budget.exhausted())
+            Changed |= AnalyzeAlloca(Worklist.pop_back_val(), TempWorklist, TryPromotelist,
+                                     Holders, Budget, Opts);
+
+        // Out of budget: allocas not looked at are only promoted if they
+        // already can be, and nothing else is tried on this function.
+        OutOfBudget = !Worklist.empty() || Budget.exhausted();
+        TryPromotelist.append(Worklist.rbegin(), Worklist.rend());
+        Worklist.clear();
+        if(!Opts.Quiet) {
+            errs() << "PRINTING FUNCTION AFTER ANALYSIS: \n";
+            F.print(errs());
+        }
+        TryPromotelist.append(TempWorklist.begin(), TempWorklist.end());
+        std::vector<AllocaInst *> AllocaList;
+        SmallVector<AllocaInst *, 4> NonPromotablelist;
+        for(auto *AI : TryPromotelist) {
+            if(!Opts.Quiet)
+                errs() << "TRY ALLOCA: " << *AI << "\n";
+            if(Opts.SplitBitfields && !OutOfBudget && SplitBitfieldAlloca(AI, AllocaList, Budget))
+                Changed = true;
+            // Allocas accessed as other types are split into pieces, which
+            // are promoted on their own if they can be
+            SmallVector<AllocaInst *, 4> Pieces;
+            if(!OutOfBudget && !isPromotableAlloca(AI) && RewritePunnedAlloca(AI, Pieces, Budget)) {
+                Changed = true;
+                Holders.erase(AI);
+                auto It = find(TempWorklist, AI);
+                if(It != TempWorklist.end())
+                    TempWorklist.erase(It);
+                for(auto *Piece : Pieces) {
+                    if(!Opts.Quiet)
+                        errs() << "PIECE: " << *Piece << "\n";
+                    if(isPromotableAlloca(Piece)) {
+                        AllocaList.push_back(Piece);
+                    } else {
+                        NonPromotablelist.push_back(Piece);
+                        Holders.record(Piece);
+                    }
+                }
+            } else if(isPromotableAlloca(AI)) {
+                AllocaList.push_back(AI);
+                if(!Opts.Quiet)
+                    errs() << "YES\n";
+            } else {
+                if(!Opts.Quiet)
+                    errs() << "NOT\n";
+                NonPromotablelist.push_back(AI);
+                Holders.record(AI);
+            }
+        }
+
+        // Allocas that escape may still live in registers within loops
+        if(Opts.LoopPromote && !OutOfBudget && !NonPromotablelist.empty() && !GetLI().empty()) {
+            LoopInfo &LI = GetLI();
+            SmallVector<Loop *, 4> TopLevelLoops(LI.begin(), LI.end());
+            for(auto *AI : NonPromotablelist)
+                Changed |= PromoteAllocaInLoops(AI, TopLevelLoops, AllocaList, Budget);
+        }
+        for(auto *AI : AllocaList)
+            Holders.erase(AI);
+        if(!AllocaList.empty())
+            Changed |= PromoteAllocas(AllocaList, F, GetDT(), AC);
+
+        // Cut down memory traffic on whatever could not be promoted
+        if(Opts.ForwardStores && !OutOfBudget) {
+            for(auto *AI : NonPromotablelist) {
+                if(ForwardSlotAccesses(AI, Budget)) {
+                    Holders.release(AI);
+                    Changed = true;
+                }
+            }
+        }
+        if(!Opts.Quiet) {
+            errs() << "PRINTING FUNCTION AFTER PROMOTION: \n";
+            F.print(errs());
+        }
+        for(auto *AI : AllocaList) {
+            auto It = find(TempWorklist, AI);
+            if(It == TempWorklist.end())
+                continue;
+            TempWorklist.erase(It);
+        }
+
+        // Allocas whose address was held by something that is gone now
+        for(auto *AI : Holders.Requeue) {
+            if(!is_contained(TempWorklist, AI))
+                TempWorklist.push_back(AI);
+        }
+        Holders.Requeue.clear();
+        Worklist = TempWorklist;
+        TempWorklist.clear();
+        Budget.Iterations++;
+        if(OutOfBudget)
+            break;
+    } while(!Worklist.empty() && !Budget.exhausted());
+
+    if(OutOfBudget || !Worklist.empty()) {
+        NumOutOfBudget++;
+        OptimizationRemarkEmitter ORE(&F);
+        ORE.emit([&] {
+            return OptimizationRemarkMissed(DEBUG_TYPE, "OutOfBudget",
+                                            &F.getEntryBlock().front())
+                   << "ran out of the " << ore::NV("Limit", Budget.exhausted()) << " budget after "
+                   << ore::NV("Iterations", Budget.Iterations) << " iterations, "
+                   << ore::NV("Allocas", Budget.Allocas) << " allocas examined and "
+                   << ore::NV("Rewrites", Budget.Rewrites) << " instructions rewritten";
+        });
+    }
+
+    return Changed;
+}
+
+// Everything which changes what the pass does to a function goes into the
+// cache key.
+static void PrintOptions(raw_ostream &OS, const ScalarReplAggregatesOptions &Opts) {
+    OS << "scalarrepl-akashk4 cache v3"
+       << " loop-promote=" << Opts.LoopPromote
+       << " forward=" << Opts.ForwardStores
+       << " bitfields=" << Opts.SplitBitfields
+       << " max-iterations=" << Opts.MaxIterations
+       << " max-allocas=" << Opts.MaxAllocas
+       << " max-rewrites=" << Opts.MaxRewrites
+       << " soa=" << Opts.StructOfArrays
+       << " constant-copies=" << Opts.ConstantCopies << "\n";
+}
+
+// Collects the globals a function refers to, directly or through constants.
+// Returns false if the function cannot be cached.
+static bool CollectGlobals(Function &F, SetVector<GlobalValue *> &Globals) {
+    if(F.hasPrefixData() || F.hasPrologueData())
+        return false;
+    SmallVector<Constant *, 8> Worklist;
+    SmallPtrSet<Constant *, 16> Visited;
+    // The cached copy needs a declaration of the personality as well
+    if(F.hasPersonalityFn())
+        Worklist.push_back(F.getPersonalityFn());
+    for(auto &BB : F) {
+        if(BB.hasAddressTaken())
+            return false;
+        for(auto &I : BB) {
+            for(auto &Op : I.operands()) {
+                if(auto *C = dyn_cast<Constant>(Op))
+                    Worklist.push_back(C);
+                else if(auto *MAV = dyn_cast<MetadataAsValue>(Op))
+                    if(auto *CAM = dyn_cast<ConstantAsMetadata>(MAV->getMetadata()))
+                        Worklist.push_back(CAM->getValue());
+            }
+        }
+    }
+    while(!Worklist.empty()) {
+        auto *C = Worklist.pop_back_val();
+        if(!Visited.insert(C).second)
+            continue;
+        if(auto *GV = dyn_cast<GlobalValue>(C)) {
+            // Only named functions and variables can be found again by name
+            if(!GV->hasName() || !(isa<Function>(GV) || isa<GlobalVariable>(GV)))
+                return false;
+            Globals.insert(GV);
+            continue;
+        }
+        if(isa<BlockAddress>(C))
+            return false;
+        for(auto &Op : C->operands())
+            Worklist.push_back(cast<Constant>(Op));
+    }
+    return true;
+}
+
+// Collects the metadata the function and its instructions refer to, and the
+// metadata that refers to in turn, short of the compile unit. Cached bodies
+// refer to it by its index here, so that it is never copied into the cache.
+static void CollectMetadata(Function &F, SetVector<Metadata *> &MDs) {
+    SmallVector<std::pair<unsigned, MDNode *>, 4> Attachments;
+    F.getAllMetadata(Attachments);
+    for(auto &Entry : Attachments)
+        MDs.insert(Entry.second);
+    for(auto &I : instructions(F)) {
+        I.getAllMetadata(Attachments);
+        for(auto &Entry : Attachments)
+            MDs.insert(Entry.second);
+        for(auto &Op : I.operands()) {
+            auto *MAV = dyn_cast<MetadataAsValue>(Op);
+            if(MAV && !isa<ValueAsMetadata>(MAV->getMetadata()))
+                MDs.insert(MAV->getMetadata());
+        }
+    }
+    for(unsigned i = 0; i < MDs.size(); ++i) {
+        auto *N = dyn_cast<MDNode>(MDs[i]);
+        if(!N || isa<DICompileUnit>(N))
+            continue;
+        for(auto &Op : N->operands()) {
+            if(Op && !isa<ValueAsMetadata>(Op))
+                MDs.insert(Op);
+        }
+    }
+}
+
+// Prints the function along with the metadata it refers to. Metadata is
+// numbered across the whole module, so the numbers are replaced with indices
+// into MDs, which only change with the function. Fails on metadata which has
+// no number, such as metadata made after the slots were handed out.
+static bool PrintWithMetadata(raw_ostream &OS, Function &F, const SetVector<Metadata *> &MDs,
+                              ModuleSlotTracker &MST) {
+    std::string Text;
+    raw_string_ostream TextOS(Text);
+    static_cast<Value &>(F).print(TextOS, MST);
+    StringMap<unsigned> Index;
+    for(unsigned i = 0; i < MDs.size(); ++i) {
+        // Strings and expressions are printed in place
+        auto *N = dyn_cast<MDNode>(MDs[i]);
+        if(!N || isa<DIExpression>(N))
+            continue;
+        std::string Ref;
+        raw_string_ostream RefOS(Ref);
+        N->printAsOperand(RefOS, MST, F.getParent());
+        StringRef Slot = StringRef(RefOS.str()).drop_front();
+        if(!StringRef(Ref).startswith("!") || Slot.empty() || !all_of(Slot, isDigit))
+            return false;
+        Index[Slot] = i;
+        if(!isa<DICompileUnit>(N)) {
+            N->print(TextOS, MST, F.getParent());
+            TextOS << "\n";
+        }
+    }
+    TextOS.flush();
+
+    for(size_t i = 0; i < Text.size(); ++i) {
+        if(Text[i] != '!' || i + 1 == Text.size() || !isDigit(Text[i + 1])) {
+            OS << Text[i];
+            continue;
+        }
+        size_t End = i + 1;
+        while(End < Text.size() && isDigit(Text[End]))
+            ++End;
+        auto It = Index.find(StringRef(Text).slice(i + 1, End));
+        if(It == Index.end())
+            return false;
+        OS << "!m" << It->second;
+        i = End - 1;
+    }
+    OS << "\n";
+    return true;
+}
+
+// Collects the named struct types a type refers to, whose bodies do not show
+// in the printed function.
+static void CollectStructTypes(Type *Ty, SetVector<StructType *> &Structs,
+                               SmallPtrSetImpl<Type *> &Visited) {
+    SmallVector<Type *, 8> Worklist(1, Ty);
+    while(!Worklist.empty()) {
+        Type *T = Worklist.pop_back_val();
+        if(!Visited.insert(T).second)
+            continue;
+        if(auto *ST = dyn_cast<StructType>(T))
+            if(!ST->isLiteral())
+                Structs.insert(ST);
+        Worklist.append(T->subtype_begin(), T->subtype_end());
+    }
+}
+
+// Same for the attribute groups, which the printed function only refers to.
+static void PrintAttributes(raw_ostream &OS, AttributeList Attrs) {
+    for(unsigned i = Attrs.index_begin(); i != Attrs.index_end(); ++i)
+        OS << Attrs.getAsString(i) << ";";
+    OS << "\n";
+}
+
+// Hashes the function body together with everything outside of it that the
+// pass looks at: the data layout, the options, the metadata, the bodies of
+// struct types, the attributes of the function, its calls and its callees,
+// and contents of constant globals.
+static bool ComputeCacheKey(Function &F, const ScalarReplAggregatesOptions &Opts,
+                            ModuleSlotTracker &MST, SmallString<32> &Key,
+                            SetVector<Metadata *> &MDs) {
+    SetVector<GlobalValue *> Globals;
+    if(!CollectGlobals(F, Globals))
+        return false;
+    CollectMetadata(F, MDs);
+
+    std::string Text;
+    raw_string_ostream OS(Text);
+    PrintOptions(OS, Opts);
+    OS << F.getParent()->getDataLayoutStr() << "\n" << F.getParent()->getTargetTriple() << "\n";
+    if(!PrintWithMetadata(OS, F, MDs, MST))
+        return false;
+
+    SetVector<StructType *> Structs;
+    SmallPtrSet<Type *, 32> Visited;
+    CollectStructTypes(F.getFunctionType(), Structs, Visited);
+    PrintAttributes(OS, F.getAttributes());
+    for(auto &I : instructions(F)) {
+        CollectStructTypes(I.getType(), Structs, Visited);
+        for(auto &Op : I.operands())
+            CollectStructTypes(Op->getType(), Structs, Visited);
+        if(auto *AI = dyn_cast<AllocaInst>(&I))
+            CollectStructTypes(AI->getAllocatedType(), Structs, Visited);
+        else if(auto *GEP = dyn_cast<GetElementPtrInst>(&I))
+            CollectStructTypes(GEP->getSourceElementType(), Structs, Visited);
+        if(auto *Call = dyn_cast<CallBase>(&I))
+            PrintAttributes(OS, Call->getAttributes());
+    }
+
+    for(auto *GV : Globals) {
+        CollectStructTypes(GV->getValueType(), Structs, Visited);
+        OS << GV->getName() << " " << *GV->getType() << " " << GV->getLinkage() << " "
+           << GV->getVisibility() << " " << static_cast<unsigned>(GV->getUnnamedAddr()) << "\n";
+        if(auto *Callee = dyn_cast<Function>(GV)) {
+            PrintAttributes(OS, Callee->getAttributes());
+        } else if(auto *GVar = dyn_cast<GlobalVariable>(GV)) {
+            OS << "align " << GVar->getAlignment() << " externally-initialized "
+               << GVar->isExternallyInitialized() << "\n";
+            if(GVar->isConstant() && GVar->hasDefinitiveInitializer())
+                OS << "constant " << *GVar->getInitializer();
+        }
+        OS << "\n";
+    }
+    for(auto *ST : Structs) {
+        ST->print(OS);
+        OS << "\n";
+    }
+
+    MD5 Hash;
+    Hash.update(OS.str());
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    Key = Result.digest();
+    return true;
+}
+
+static std::string GetCachePath(StringRef Key) {
+    SmallString<128> Path(CacheDir);
+    sys::path::append(Path, Key + ".bc");
+    return Path.str().str();
+}
+
+// Cached bodies refer to local symbols through declarations with these names.
+static const char *const CachedLocalPrefix = "__sroa_local.";
+static const char *const CachedFunctionPrefix = "__sroa_cached.";
+
+// The bitcode reader strips debug info from modules without a debug info
+// version, which the cache modules lack, so debug intrinsics go by another
+// name and metadata is kept in placeholders under a kind of our own.
+static const char *const CachedIntrinsicPrefix = "__sroa_intrinsic.";
+static const char *const CachedMetadataKind = "sroa.cache.md";
+
+// Placeholder for metadata of a body about to be cached: its index in MDs, or
+// for locations and expressions the pass made, their fields.
+static Metadata *EncodeMetadataRef(LLVMContext &Ctx, Metadata *MD,
+                                   const DenseMap<Metadata *, unsigned> &Index) {
+    auto Int = [&](int64_t V) {
+        return ConstantAsMetadata::get(ConstantInt::get(Type::getInt64Ty(Ctx), V));
+    };
+    auto It = Index.find(MD);
+    if(It != Index.end())
+        return MDTuple::get(Ctx, {MDString::get(Ctx, "sroa.md"), Int(It->second)});
+    if(auto *Loc = dyn_cast<DILocation>(MD)) {
+        auto Scope = Index.find(Loc->getScope());
+        auto InlinedAt = Loc->getInlinedAt() ? Index.find(Loc->getInlinedAt()) : Index.end();
+        if(Scope == Index.end() || (Loc->getInlinedAt() && InlinedAt == Index.end()))
+            return nullptr;
+        return MDTuple::get(Ctx, {MDString::get(Ctx, "sroa.loc"), Int(Loc->getLine()),
+                                  Int(Loc->getColumn()), Int(Scope->second),
+                                  Int(InlinedAt == Index.end() ? -1 : int64_t(InlinedAt->second))});
+    }
+    if(auto *Expr = dyn_cast<DIExpression>(MD)) {
+        SmallVector<Metadata *, 8> Ops(1, MDString::get(Ctx, "sroa.expr"));
+        for(uint64_t Elem : Expr->getElements())
+            Ops.push_back(Int(Elem));
+        return MDTuple::get(Ctx, Ops);
+    }
+    return nullptr;
+}
+
+// Swaps the metadata of a body about to be cached for placeholders. Fails on
+// metadata made by the pass other than locations and expressions.
+static bool EncodeMetadata(Function &F, const SetVector<Metadata *> &MDs) {
+    LLVMContext &Ctx = F.getContext();
+    DenseMap<Metadata *, unsigned> Index;
+    for(unsigned i = 0; i < MDs.size(); ++i)
+        Index[MDs[i]] = i;
+    SmallVector<StringRef, 16> KindNames;
+    Ctx.getMDKindNames(KindNames);
+    SmallVector<std::pair<unsigned, MDNode *>, 4> Attachments;
+    for(auto &I : instructions(F)) {
+        for(auto &Op : I.operands()) {
+            auto *MAV = dyn_cast<MetadataAsValue>(Op);
+            if(!MAV || isa<ValueAsMetadata>(MAV->getMetadata()))
+                continue;
+            Metadata *MD = EncodeMetadataRef(Ctx, MAV->getMetadata(), Index);
+            if(!MD)
+                return false;
+            Op.set(MetadataAsValue::get(Ctx, MD));
+        }
+        I.getAllMetadata(Attachments);
+        if(Attachments.empty())
+            continue;
+        SmallVector<Metadata *, 8> Ops;
+        for(auto &Entry : Attachments) {
+            Metadata *MD = EncodeMetadataRef(Ctx, Entry.second, Index);
+            if(!MD)
+                return false;
+            Ops.push_back(MDString::get(Ctx, KindNames[Entry.first]));
+            Ops.push_back(MD);
+            I.setMetadata(Entry.first, nullptr);
+        }
+        I.setMetadata(CachedMetadataKind, MDTuple::get(Ctx, Ops));
+    }
+    return true;
+}
+
+// Metadata of the function being restored for a placeholder.
+static Metadata *DecodeMetadataRef(LLVMContext &Ctx, Metadata *MD,
+                                   const SetVector<Metadata *> &MDs) {
+    auto *Tuple = dyn_cast<MDTuple>(MD);
+    auto *Tag = Tuple && Tuple->getNumOperands() ? dyn_cast<MDString>(Tuple->getOperand(0)) : nullptr;
+    if(!Tag)
+        return nullptr;
+    SmallVector<int64_t, 8> Ints;
+    for(auto &Op : drop_begin(Tuple->operands(), 1)) {
+        auto *C = mdconst::dyn_extract_or_null<ConstantInt>(Op.get());
+        if(!C)
+            return nullptr;
+        Ints.push_back(C->getSExtValue());
+    }
+    auto Lookup = [&](int64_t I) -> Metadata * {
+        return I >= 0 && uint64_t(I) < MDs.size() ? MDs[I] : nullptr;
+    };
+    if(Tag->getString() == "sroa.md" && Ints.size() == 1)
+        return Lookup(Ints[0]);
+    if(Tag->getString() == "sroa.loc" && Ints.size() == 4) {
+        auto *Scope = dyn_cast_or_null<DILocalScope>(Lookup(Ints[2]));
+        auto *InlinedAt = dyn_cast_or_null<DILocation>(Lookup(Ints[3]));
+        if(!Scope || (Ints[3] >= 0 && !InlinedAt))
+            return nullptr;
+        return DILocation::get(Ctx, Ints[0], Ints[1], Scope, InlinedAt);
+    }
+    if(Tag->getString() == "sroa.expr") {
+        SmallVector<uint64_t, 8> Elements(Ints.begin(), Ints.end());
+        return DIExpression::get(Ctx, Elements);
+    }
+    return nullptr;
+}
+
+// Puts the metadata of the function being restored back in place of the
+// placeholders of a cached body.
+static bool DecodeMetadata(Function &F, const SetVector<Metadata *> &MDs) {
+    LLVMContext &Ctx = F.getContext();
+    unsigned Kind = Ctx.getMDKindID(CachedMetadataKind);
+    for(auto &I : instructions(F)) {
+        for(auto &Op : I.operands()) {
+            auto *MAV = dyn_cast<MetadataAsValue>(Op);
+            if(!MAV || isa<ValueAsMetadata>(MAV->getMetadata()))
+                continue;
+            Metadata *MD = DecodeMetadataRef(Ctx, MAV->getMetadata(), MDs);
+            if(!MD)
+                return false;
+            Op.set(MetadataAsValue::get(Ctx, MD));
+        }
+        MDNode *Attachments = I.getMetadata(Kind);
+        if(!Attachments)
+            continue;
+        I.setMetadata(Kind, nullptr);
+        if(Attachments->getNumOperands() % 2)
+            return false;
+        for(unsigned i = 0; i < Attachments->getNumOperands(); i += 2) {
+            auto *Name = dyn_cast<MDString>(Attachments->getOperand(i));
+            auto *N = dyn_cast_or_null<MDNode>(
+                DecodeMetadataRef(Ctx, Attachments->getOperand(i + 1), MDs));
+            if(!Name || !N)
+                return false;
+            unsigned K = Ctx.getMDKindID(Name->getString());
+            if(K == LLVMContext::MD_dbg && !isa<DILocation>(N))
+                return false;
+            I.setMetadata(K, N);
+        }
+    }
+    return true;
+}
+
+// Writes the transformed function into the cache, as a module of its own.
+// Functions the pass did not change are recorded with an empty file. MDs is
+// the metadata of the function as it was when the key was computed.
+static void StoreInCache(Function &F, StringRef Key, bool Changed,
+                         const SetVector<Metadata *> &MDs) {
+    std::unique_ptr<Module> CM;
+    if(Changed) {
+        SetVector<GlobalValue *> Globals;
+        if(!CollectGlobals(F, Globals))
+            return;
+
+        Module &M = *F.getParent();
+        CM.reset(new Module("sroa-cache", F.getContext()));
+        CM->setDataLayout(M.getDataLayout());
+        CM->setTargetTriple(M.getTargetTriple());
+        ValueToValueMapTy VMap;
+        for(auto *GV : Globals) {
+            std::string Name = GV->getName().str();
+            if(GV->hasLocalLinkage())
+                Name = CachedLocalPrefix + Name;
+            else if(GV->getName().startswith("llvm.dbg."))
+                Name = CachedIntrinsicPrefix + Name;
+            GlobalValue *Decl;
+            if(auto *Callee = dyn_cast<Function>(GV)) {
+                Decl = Function::Create(Callee->getFunctionType(), GlobalValue::ExternalLinkage,
+                                        Name, CM.get());
+            } else {
+                auto *GVar = cast<GlobalVariable>(GV);
+                Decl = new GlobalVariable(*CM, GVar->getValueType(), GVar->isConstant(),
+                                          GlobalValue::ExternalLinkage, nullptr, Name, nullptr,
+                                          GVar->getThreadLocalMode(),
+                                          GVar->getType()->getAddressSpace());
+            }
+            // The linker merges these into the definition when restoring
+            Decl->setUnnamedAddr(GV->getUnnamedAddr());
+            if(!GV->hasLocalLinkage())
+                Decl->setVisibility(GV->getVisibility());
+            VMap[GV] = Decl;
+        }
+        auto *NewF = Function::Create(F.getFunctionType(), GlobalValue::ExternalLinkage,
+                                      CachedFunctionPrefix + Key, CM.get());
+        for(auto Args : zip(F.args(), NewF->args()))
+            VMap[&std::get<0>(Args)] = &std::get<1>(Args);
+        // Metadata stays where it is and is only referred to
+        for(auto *MD : MDs)
+            VMap.MD()[MD].reset(MD);
+        SmallVector<ReturnInst *, 4> Returns;
+        CloneFunctionInto(NewF, &F, VMap, /* ModuleLevelChanges */ true, Returns);
+        NewF->clearMetadata();
+        if(!EncodeMetadata(*NewF, MDs))
+            return;
+    }
+
+    // Write next to the final file and move it over, so that concurrent
+    // builds never see half of an entry.
+    std::string Path = GetCachePath(Key);
+    SmallString<128> TempPath;
+    int FD;
+    if(sys::fs::create_directories(CacheDir)
+        || sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TempPath))
+        return;
+    {
+        raw_fd_ostream OS(FD, /* shouldClose */ true);
+        if(CM)
+            WriteBitcodeToFile(*CM, OS);
+    }
+    if(sys::fs::rename(TempPath, Path))
+        sys::fs::remove(TempPath);
+}
+
+// Replaces the body of the function with the cached one. Returns false if
+// there is no usable entry, in which case the function is left alone.
+static bool RestoreFromCache(Function &F, StringRef Key, const SetVector<Metadata *> &MDs,
+                             bool &Changed) {
+    auto BufferOrErr = MemoryBuffer::getFile(GetCachePath(Key));
+    if(!BufferOrErr)
+        return false;
+    if(!(*BufferOrErr)->getBufferSize()) {
+        Changed = false;
+        return true;
+    }
+    auto CMOrErr = parseBitcodeFile((*BufferOrErr)->getMemBufferRef(), F.getContext());
+    if(!CMOrErr) {
+        consumeError(CMOrErr.takeError());
+        return false;
+    }
+
+    // Every global the cached body refers to must still be around
+    Module &M = *F.getParent();
+    std::string CachedName = CachedFunctionPrefix + Key.str();
+    SmallVector<std::pair<std::string, GlobalValue *>, 4> Locals;
+    SmallVector<std::pair<std::string, Intrinsic::ID>, 2> Intrinsics;
+    for(auto &GV : (*CMOrErr)->global_values()) {
+        StringRef Name = GV.getName();
+        if(Name == CachedName || Name.startswith("llvm."))
+            continue;
+        if(Name.startswith(CachedLocalPrefix)) {
+            auto *Local = M.getNamedValue(Name.drop_front(StringRef(CachedLocalPrefix).size()));
+            if(!Local || !Local->hasLocalLinkage())
+                return false;
+            Locals.push_back(std::make_pair(Name.str(), Local));
+            continue;
+        }
+        if(Name.startswith(CachedIntrinsicPrefix)) {
+            Intrinsic::ID ID =
+                Function::lookupIntrinsicID(Name.drop_front(StringRef(CachedIntrinsicPrefix).size()));
+            if(ID == Intrinsic::not_intrinsic)
+                return false;
+            Intrinsics.push_back(std::make_pair(Name.str(), ID));
+            continue;
+        }
+        if(!M.getNamedValue(Name))
+            return false;
+    }
+    if(Linker::linkModules(M, std::move(*CMOrErr)))
+        return false;
+
+    // Point the declarations standing in for local symbols and debug
+    // intrinsics at the real ones
+    for(auto &Entry : Intrinsics)
+        Locals.push_back(std::make_pair(Entry.first, Intrinsic::getDeclaration(&M, Entry.second)));
+    auto *Cached = M.getFunction(CachedName);
+    bool Broken = !Cached;
+    for(auto &Entry : Locals) {
+        auto *Decl = M.getNamedValue(Entry.first);
+        if(!Decl || Decl->getType() != Entry.second->getType()) {
+            Broken = true;
+            continue;
+        }
+        Decl->replaceAllUsesWith(Entry.second);
+        Decl->eraseFromParent();
+    }
+    if(!Broken && !DecodeMetadata(*Cached, MDs))
+        Broken = true;
+    if(Broken) {
+        if(Cached)
+            Cached->eraseFromParent();
+        for(auto &Entry : Locals) {
+            auto *Decl = M.getNamedValue(Entry.first);
+            if(Decl && Decl->use_empty())
+                Decl->eraseFromParent();
+        }
+        return false;
+    }
+
+    // Swap the bodies
+    for(auto &BB : F)
+        BB.dropAllReferences();
+    while(!F.empty())
+        F.begin()->eraseFromParent();
+    F.getBasicBlockList().splice(F.end(), Cached->getBasicBlockList());
+    for(auto Args : zip(Cached->args(), F.args()))
+        std::get<0>(Args).replaceAllUsesWith(&std::get<1>(Args));
+    Cached->eraseFromParent();
+    Changed = true;
+    return true;
+}
+
+bool SROA::runOnFunction(Function &F) {
+ // Get dominator tree and assumptions cache
+    auto &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    auto &AC = getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F);
+
+    // Functions which did not change since the last build come from the cache
+    ScalarReplAggregatesOptions Opts = PassOpts ? *PassOpts : ScalarReplAggregatesOptions();
+    SmallString<32> Key;
+    SetVector<Metadata *> MDs;
+    bool Cacheable = MST && ComputeCacheKey(F, Opts, *MST, Key, MDs);
+    bool Changed;
+    if(Cacheable && RestoreFromCache(F, Key, MDs, Changed)) {
+        if(Changed)
+            AC.clear();
+        return Changed;
+    }
+
+    // Run the analysis
+    Changed = RunOnFunction(F, Opts, [&]() -> DominatorTree & { return DT; }, AC,
+                            [&]() -> LoopInfo & {
+                                return getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+                            });
+    if(Cacheable)
+        StoreInCache(F, Key, Changed, MDs);
+
+    // Print the stats
+    if(!Opts.Quiet) {
+        errs() << "Number of aggregate allocas broken up: " << NumReplaced << "\n";
+        errs() << "Number of scalar allocas promoted to register: " << NumPromoted << "\n";
+    }
+
+    return Changed;
+}
+
+bool runScalarReplAggregates(Function &F, const ScalarReplAggregatesOptions &Options) {
+    if(F.isDeclaration())
+        return false;
+
+    // Nothing is traced for functions compiled on the fly
+    ScalarReplAggregatesOptions Opts = Options;
+    Opts.Quiet = true;
+
+    // Assumptions are only scanned for once they are asked for
+    AssumptionCache AC(F);
+    Optional<DominatorTree> DT;
+    Optional<LoopInfo> LI;
+    auto GetDT = [&]() -> DominatorTree & {
+        if(!DT)
+            DT.emplace(F);
+        return *DT;
+    };
+    auto GetLI = [&]() -> LoopInfo & {
+        if(!LI)
+            LI.emplace(GetDT());
+        return *LI;
+    };
+    return RunOnFunction(F, Opts, GetDT, AC, GetLI);
+}
+
+orc::IRTransformLayer::TransformFunction
+createScalarReplAggregatesTransform(const ScalarReplAggregatesOptions &Opts) {
+    return [Opts](orc::ThreadSafeModule TSM, const orc::MaterializationResponsibility &R)
+               -> Expected<orc::ThreadSafeModule> {
+        // Other modules of the context may be compiled concurrently
+        auto Lock = TSM.getContextLock();
+        for(auto &F : *TSM.getModule())
+            runScalarReplAggregates(F, Opts);
+        return std::move(TSM);
+    };
 }
@@ -0,0 +1,61 @@
+//===--------- SROA.h - Scalar Replacement of Aggregates --------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Interface to run the scalar replacement of aggregates transformation in
+// process, without a pass manager. This is meant for code generated at run
+// time, e.g. in a JIT.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef SCALARREPLAGGREGATES_AKASHK4_H
+#define SCALARREPLAGGREGATES_AKASHK4_H
+
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+
+namespace llvm {
+class Function;
+class FunctionPass;
+}
+
+// What the transformation does. Defaults to the command line options of the
+// pass, so a program which never parses them gets the pass defaults.
+struct ScalarReplAggregatesOptions {
+    bool LoopPromote;
+    bool ForwardStores;
+    bool SplitBitfields;
+    unsigned AnalysisThreads;
+    unsigned AnalysisThreshold;
+    unsigned MaxIterations;
+    unsigned MaxAllocas;
+    unsigned MaxRewrites;
+    bool StructOfArrays;
+    bool ConstantCopies;
+    bool Quiet;
+
+    ScalarReplAggregatesOptions();
+};
+
+// Runs the transformation on one function. The dominator tree and loop info
+// are only computed once they are needed, and nothing is traced whatever
+// Opts.Quiet says. Returns true if F changed.
+bool runScalarReplAggregates(llvm::Function &F,
+                             const ScalarReplAggregatesOptions &Opts = ScalarReplAggregatesOptions());
+
+// Transform for an ORC IRTransformLayer, running the transformation on every
+// function of a module as it is materialized. Below a CompileOnDemandLayer,
+// this is when a function is first called.
+llvm::orc::IRTransformLayer::TransformFunction
+createScalarReplAggregatesTransform(const ScalarReplAggregatesOptions &Opts = ScalarReplAggregatesOptions());
+
+// Public interface to create the ScalarReplAggregates pass. Without options,
+// the pass reads the command line options when it runs.
+llvm::FunctionPass *createMyScalarReplAggregatesPass();
+llvm::FunctionPass *createMyScalarReplAggregatesPass(const ScalarReplAggregatesOptions &Opts);
+
+#endif
@@ -0,0 +1,166 @@
+//===------- sroa-compare.cpp - Compare against the stock SROA pass -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This harness runs this scalar replacement of aggregates pass and the stock
+// LLVM SROA pass side by side on each function of the given modules. For
+// every function it reports the allocas, loads and stores left, the number
+// of instructions, and how long the pass took on it, as CSV. The function
+// before any pass is reported as the "input" variant.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ScalarReplAggregates-akashk4.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Pass.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <chrono>
+#include <functional>
+#include <map>
+
+using namespace llvm;
+
+static cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore,
+                                        cl::desc("<input .ll or .bc files>"));
+
+namespace {
+  struct FunctionStats {
+    unsigned Allocas = 0;
+    unsigned Loads = 0;
+    unsigned Stores = 0;
+    unsigned Instructions = 0;
+    double Seconds = 0;
+    unsigned Functions = 0;
+
+    void add(const FunctionStats &Other) {
+        Allocas += Other.Allocas;
+        Loads += Other.Loads;
+        Stores += Other.Stores;
+        Instructions += Other.Instructions;
+        Seconds += Other.Seconds;
+        Functions += Other.Functions;
+    }
+  };
+}
+
+// Totals over all inputs, per variant
+static std::map<std::string, FunctionStats> Totals;
+
+static FunctionStats CountInstructions(Function &F) {
+    FunctionStats Stats;
+    Stats.Functions = 1;
+    for(auto &I : instructions(F)) {
+        Stats.Instructions++;
+        if(isa<AllocaInst>(I))
+            Stats.Allocas++;
+        else if(isa<LoadInst>(I))
+            Stats.Loads++;
+        else if(isa<StoreInst>(I))
+            Stats.Stores++;
+    }
+    return Stats;
+}
+
+static void PrintRow(StringRef File, StringRef Function, StringRef Variant,
+                     const FunctionStats &Stats) {
+    outs() << File << "," << Function << "," << Variant << ","
+           << Stats.Allocas << "," << Stats.Loads << "," << Stats.Stores << ","
+           << Stats.Instructions << ","
+           << format("%.1f", Stats.Seconds * 1e6) << "\n";
+    Totals[Variant.str()].add(Stats);
+}
+
+// Runs a pass over every function of a private copy of the module. Only the
+// pass itself is timed, along with the analyses it requires. Dead code is
+// cleaned up afterwards for both variants alike, as tests/Makefile does with
+// -dce.
+static void RunVariant(Module &Input, StringRef File, StringRef Variant,
+                       std::function<Pass *()> CreatePass) {
+    std::unique_ptr<Module> M = CloneModule(Input);
+    legacy::FunctionPassManager FPM(M.get());
+    FPM.add(CreatePass());
+    legacy::FunctionPassManager Cleanup(M.get());
+    Cleanup.add(createDeadCodeEliminationPass());
+    FPM.doInitialization();
+    Cleanup.doInitialization();
+    for(auto &F : *M) {
+        if(F.isDeclaration())
+            continue;
+        auto Start = std::chrono::steady_clock::now();
+        FPM.run(F);
+        std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+        Cleanup.run(F);
+
+        FunctionStats Stats = CountInstructions(F);
+        Stats.Seconds = Elapsed.count();
+        PrintRow(File, F.getName(), Variant, Stats);
+    }
+    FPM.doFinalization();
+    Cleanup.doFinalization();
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+
+    // The pass managers look up required analyses in the registry.
+    PassRegistry &Registry = *PassRegistry::getPassRegistry();
+    initializeCore(Registry);
+    initializeAnalysis(Registry);
+    initializeTransformUtils(Registry);
+    initializeScalarOpts(Registry);
+
+    cl::ParseCommandLineOptions(argc, argv, "Compare against the stock SROA pass\n");
+
+    int Failed = 0;
+    outs() << "file,function,variant,allocas,loads,stores,instructions,time_us\n";
+    for(const auto &File : InputFiles) {
+        LLVMContext Ctx;
+        SMDiagnostic Diag;
+        std::unique_ptr<Module> M = parseIRFile(File, Diag, Ctx);
+        if(!M) {
+            Diag.print("sroa-compare", errs());
+            Failed = 1;
+            continue;
+        }
+
+        for(auto &F : *M) {
+            if(!F.isDeclaration())
+                PrintRow(File, F.getName(), "input", CountInstructions(F));
+        }
+        RunVariant(*M, File, "scalarrepl-akashk4", [] {
+            // The traces of the pass would be timed along with it
+            ScalarReplAggregatesOptions Opts;
+            Opts.Quiet = true;
+            return createMyScalarReplAggregatesPass(Opts);
+        });
+        RunVariant(*M, File, "sroa", createSROAPass);
+    }
+
+    for(auto &Entry : Totals) {
+        auto &Stats = Entry.second;
+        outs() << "# total " << Entry.first << ": functions=" << Stats.Functions
+               << " allocas=" << Stats.Allocas << " loads=" << Stats.Loads
+               << " stores=" << Stats.Stores << " instructions=" << Stats.Instructions
+               << " time_us=" << format("%.1f", Stats.Seconds * 1e6) << "\n";
+    }
+    return Failed;
+}
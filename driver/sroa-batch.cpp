@@ -0,0 +1,239 @@
+//===------- sroa-batch.cpp - Batch driver for the SROA pass --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This driver runs the scalar replacement of aggregates pass over many
+// modules in a single process, instead of one opt invocation with a plugin
+// load per file. Bitcode inputs are memory mapped, modules are processed on a
+// thread pool with one LLVMContext per module, and every result is written
+// out as soon as its module is done. The pass runs quiet, since its traces
+// would interleave and cost more than the transformation itself.
+//
+// With -one-at-a-time, modules are processed one after another instead, and
+// the workers go to the pass, which plans the allocas of a function on all of
+// them. An LLVMContext is not thread-safe, and every rewrite touches state
+// shared by the whole module (uniqued constants and types, use lists of
+// constants and globals), so the plans are committed one at a time. Planning
+// only reads the IR, so the module stays in its own context throughout, and
+// nothing is split, serialized or linked.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ScalarReplAggregates-akashk4.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/BinaryFormat/Magic.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Pass.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Scalar.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore,
+                                        cl::desc("<input bitcode files>"));
+
+static cl::opt<std::string> OutputDir("o", cl::desc("Output directory"),
+                                      cl::value_desc("directory"), cl::init("."));
+
+static cl::opt<unsigned> Jobs("j", cl::desc("Number of worker threads (0 = all cores)"),
+                              cl::init(0));
+
+static cl::opt<bool> OutputAssembly("S", cl::desc("Write textual IR instead of bitcode"));
+
+static cl::opt<bool> NoVerify("disable-verify", cl::desc("Do not verify the result"));
+
+static cl::opt<bool> OneAtATime("one-at-a-time",
+                                cl::desc("Process one module at a time, planning the allocas "
+                                         "of each function on all worker threads"));
+
+static cl::opt<std::string> TimeTrace("time-trace",
+                                      cl::desc("Write a Chrome trace of the pass phases "
+                                               "to this file"),
+                                      cl::value_desc("filename"), cl::init(""));
+
+// Output file for an input, keeping its name but not its directory. Inputs
+// which would share an output file are rejected up front.
+static std::string getOutputPath(StringRef Input) {
+    SmallString<128> Path(OutputDir);
+    sys::path::append(Path, sys::path::filename(Input));
+    sys::path::replace_extension(Path, OutputAssembly ? "ll" : "bc");
+    return Path.str().str();
+}
+
+// Same pipeline as tests/Makefile
+static void RunPipeline(Module &M, unsigned AnalysisThreads = 1) {
+    ScalarReplAggregatesOptions Opts;
+    Opts.Quiet = true;
+    Opts.AnalysisThreads = AnalysisThreads;
+    legacy::PassManager PM;
+    PM.add(createMyScalarReplAggregatesPass(Opts));
+    PM.add(createDeadCodeEliminationPass());
+    if(!NoVerify)
+        PM.add(createVerifierPass());
+    PM.run(M);
+}
+
+// Loads a module into the given context. Returns null and sets the error
+// message on failure.
+static std::unique_ptr<Module> LoadFile(StringRef Input, LLVMContext &Ctx, std::string &Err) {
+    // The IR lexer finds the end of textual IR by its null terminator. Only
+    // bitcode can be memory mapped without one.
+    file_magic Magic;
+    if(std::error_code EC = identify_magic(Input, Magic)) {
+        Err = EC.message();
+        return nullptr;
+    }
+    bool IsBitcode = Magic == file_magic::bitcode;
+    auto BufferOrErr = MemoryBuffer::getFile(Input, -1, /*RequiresNullTerminator=*/!IsBitcode);
+    if(std::error_code EC = BufferOrErr.getError()) {
+        Err = EC.message();
+        return nullptr;
+    }
+
+    SMDiagnostic Diag;
+    std::unique_ptr<Module> M = parseIR((*BufferOrErr)->getMemBufferRef(), Diag, Ctx);
+    if(!M) {
+        raw_string_ostream OS(Err);
+        Diag.print("sroa-batch", OS, false);
+        OS.flush();
+    }
+    return M;
+}
+
+static std::string WriteFile(Module &M, StringRef Input) {
+    std::error_code EC;
+    ToolOutputFile Out(getOutputPath(Input), EC, sys::fs::F_None);
+    if(EC)
+        return EC.message();
+    if(OutputAssembly)
+        M.print(Out.os(), nullptr);
+    else
+        WriteBitcodeToFile(M, Out.os());
+    Out.keep();
+    return "";
+}
+
+// Loads, transforms and writes out one module. Returns an empty string on
+// success, or the error message.
+// The allocas of a function are planned on AnalysisThreads threads.
+static std::string ProcessFile(StringRef Input, unsigned AnalysisThreads = 1) {
+    // A fresh context per module. Named types are never freed, so a shared
+    // context would rename the types of later modules.
+    LLVMContext Ctx;
+    std::string Err;
+    std::unique_ptr<Module> M = LoadFile(Input, Ctx, Err);
+    if(!M)
+        return Err;
+    RunPipeline(*M, AnalysisThreads);
+    return WriteFile(*M, Input);
+}
+
+int main(int argc, char **argv) {
+    InitLLVM X(argc, argv);
+
+    // The pass manager looks up required analyses in the registry.
+    PassRegistry &Registry = *PassRegistry::getPassRegistry();
+    initializeCore(Registry);
+    initializeAnalysis(Registry);
+    initializeTransformUtils(Registry);
+    initializeScalarOpts(Registry);
+
+    cl::ParseCommandLineOptions(argc, argv, "Batch scalar replacement of aggregates\n");
+
+    StringMap<std::string> Outputs;
+    for(const auto &Input : InputFiles) {
+        auto Inserted = Outputs.insert({getOutputPath(Input), Input});
+        if(!Inserted.second) {
+            errs() << "sroa-batch: " << Input << " and " << Inserted.first->second
+                   << " would both be written to " << Inserted.first->first() << "\n";
+            return 1;
+        }
+    }
+
+    if(std::error_code EC = sys::fs::create_directories(OutputDir)) {
+        errs() << "sroa-batch: " << OutputDir << ": " << EC.message() << "\n";
+        return 1;
+    }
+
+    // The time trace profiler records into a single trace, so everything runs
+    // on one worker then.
+    unsigned Threads = Jobs ? unsigned(Jobs) : hardware_concurrency();
+    if(!TimeTrace.empty()) {
+        timeTraceProfilerInitialize();
+        Threads = 1;
+    }
+
+    std::mutex OutputLock;
+    std::atomic<unsigned> Failed(0);
+    if(OneAtATime) {
+        // The pass starts its own threads for the functions worth it
+        for(const auto &Input : InputFiles) {
+            std::string Err = ProcessFile(Input, Threads);
+            if(!Err.empty()) {
+                errs() << "sroa-batch: " << Input << ": " << Err << "\n";
+                Failed++;
+                continue;
+            }
+            outs() << Input << " -> " << getOutputPath(Input) << "\n";
+            outs().flush();
+        }
+    } else {
+        ThreadPool Pool(Threads);
+        for(const auto &Input : InputFiles) {
+            Pool.async([&, Input] {
+                std::string Err = ProcessFile(Input);
+                std::lock_guard<std::mutex> Lock(OutputLock);
+                if(!Err.empty()) {
+                    errs() << "sroa-batch: " << Input << ": " << Err << "\n";
+                    Failed++;
+                    return;
+                }
+                outs() << Input << " -> " << getOutputPath(Input) << "\n";
+                outs().flush();
+            });
+        }
+        Pool.wait();
+    }
+
+    if(!TimeTrace.empty()) {
+        std::error_code EC;
+        std::unique_ptr<raw_pwrite_stream> OS(new raw_fd_ostream(TimeTrace, EC, sys::fs::F_Text));
+        if(EC) {
+            errs() << "sroa-batch: " << TimeTrace << ": " << EC.message() << "\n";
+            Failed++;
+        } else {
+            timeTraceProfilerWrite(OS);
+            OS->flush();
+        }
+        timeTraceProfilerCleanup();
+    }
+
+    return Failed ? 1 : 0;
+}
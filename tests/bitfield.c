@@ -0,0 +1,14 @@
+struct FLAGS {
+    unsigned ack : 1;
+    unsigned syn : 1;
+    unsigned fin : 1;
+    int window : 13;
+};
+int main () {
+    struct FLAGS f;
+    f.ack = 1;
+    f.syn = 0;
+    f.window = -4;
+    f.fin = f.ack;
+    return f.window + f.syn;
+}
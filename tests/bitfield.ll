@@ -0,0 +1,28 @@
+; Bitfields as clang lays them out: a 16 bit word in a 4 byte struct, read
+; and written through a bitcast. Every field gets an alloca of its own,
+; which Mem2Reg promotes, so no field is read back from the word.
+; RUN: opt < %s -load SROA.so -scalarrepl-akashk4 -scalarrepl-akashk4-bitfields -S | FileCheck %s
+; CHECK-LABEL: @flags(
+; CHECK-NOT: load i16
+; CHECK: trunc i16 {{.*}} to i1
+; CHECK-NOT: load i16
+; CHECK: zext i1 {{.*}} to i16
+; CHECK-NOT: load i16
+; CHECK: ret i16
+
+%struct.FLAGS = type { i16, [2 x i8] }
+
+define i16 @flags(i16 %a) {
+entry:
+  %f = alloca %struct.FLAGS, align 4
+  %w = bitcast %struct.FLAGS* %f to i16*
+  store i16 0, i16* %w, align 4
+  %l0 = load i16, i16* %w, align 4
+  %clear = and i16 %l0, -2
+  %ack = and i16 %a, 1
+  %set = or i16 %clear, %ack
+  store i16 %set, i16* %w, align 4
+  %l1 = load i16, i16* %w, align 4
+  %r = and i16 %l1, 1
+  ret i16 %r
+}
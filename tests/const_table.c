@@ -0,0 +1,7 @@
+int lookup(int i) {
+    const int table[16] = {3, 1, 4, 1, 5, 9, 2, 6, 5, 3, 5, 8, 9, 7, 9, 3};
+    return table[i & 15];
+}
+int main () {
+    return lookup(7);
+}
@@ -0,0 +1,62 @@
+; A coroutine before CoroSplit which keeps a pair on the stack. Only the
+; first field is read after the suspend point, so once the pair is split,
+; only that field is live across the suspend and has to go to the frame.
+; The promise is reached through llvm.coro.id and has to stay whole. It is
+; the caller's window into the frame, so its accesses are left alone too,
+; even the ones store forwarding would otherwise fold.
+; RUN: opt < %s -load SROA.so -scalarrepl-akashk4 -S | FileCheck %s
+; CHECK: %promise = alloca %pair
+; CHECK-NOT: %p = alloca %pair
+; CHECK: store i32 %n, i32* %pa
+; CHECK: %vp = load i32, i32* %pa
+; CHECK: call void @print(i32 %vp)
+
+%pair = type { i32, i32 }
+
+define i8* @f(i32 %n) "coroutine.presplit"="0" {
+entry:
+  %promise = alloca %pair
+  %p = alloca %pair
+  %pv = bitcast %pair* %promise to i8*
+  %id = call token @llvm.coro.id(i32 0, i8* %pv, i8* null, i8* null)
+  %size = call i32 @llvm.coro.size.i32()
+  %alloc = call i8* @malloc(i32 %size)
+  %hdl = call i8* @llvm.coro.begin(token %id, i8* %alloc)
+  %pa = getelementptr %pair, %pair* %promise, i32 0, i32 0
+  store i32 %n, i32* %pa
+  %vp = load i32, i32* %pa
+  call void @print(i32 %vp)
+  %a = getelementptr %pair, %pair* %p, i32 0, i32 0
+  %b = getelementptr %pair, %pair* %p, i32 0, i32 1
+  store i32 %n, i32* %a
+  store i32 %n, i32* %b
+  %vb = load i32, i32* %b
+  call void @print(i32 %vb)
+  %0 = call i8 @llvm.coro.suspend(token none, i1 false)
+  switch i8 %0, label %suspend [i8 0, label %resume
+                                i8 1, label %cleanup]
+resume:
+  %va = load i32, i32* %a
+  call void @print(i32 %va)
+  br label %cleanup
+
+cleanup:
+  %mem = call i8* @llvm.coro.free(token %id, i8* %hdl)
+  call void @free(i8* %mem)
+  br label %suspend
+
+suspend:
+  %unused = call i1 @llvm.coro.end(i8* %hdl, i1 false)
+  ret i8* %hdl
+}
+
+declare token @llvm.coro.id(i32, i8*, i8*, i8*)
+declare i32 @llvm.coro.size.i32()
+declare i8* @llvm.coro.begin(token, i8*)
+declare i8 @llvm.coro.suspend(token, i1)
+declare i8* @llvm.coro.free(token, i8*)
+declare i1 @llvm.coro.end(i8*, i1)
+
+declare noalias i8* @malloc(i32)
+declare void @print(i32)
+declare void @free(i8*)
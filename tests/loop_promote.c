@@ -0,0 +1,21 @@
+// Exercises -scalarrepl-akashk4-loop-promote: acc escapes only after the loop.
+struct ACC {
+    int sum;
+    int count;
+};
+void report(struct ACC *acc) {
+    acc->sum /= acc->count ? acc->count : 1;
+}
+int average(int *v, int n) {
+    struct ACC acc = {0, 0};
+    for(int i = 0; i < n; i++) {
+        acc.sum += v[i];
+        acc.count++;
+    }
+    report(&acc);
+    return acc.sum;
+}
+int main () {
+    int v[4] = {1, 2, 3, 4};
+    return average(v, 4);
+}
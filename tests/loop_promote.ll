@@ -0,0 +1,56 @@
+; The accumulator of tests/loop_promote.c as clang -O0 emits it. It is zero
+; initialized through a memset and escapes only after the loop, so both of
+; its fields live in registers within the loop and are written back at the
+; exit.
+; RUN: opt < %s -load SROA.so -scalarrepl-akashk4 -scalarrepl-akashk4-loop-promote -S | FileCheck %s
+; CHECK-LABEL: @average(
+; CHECK: %acc = alloca %struct.ACC
+; CHECK: call void @llvm.memset
+; CHECK: %acc.pre = load i32
+; CHECK: header:
+; CHECK: phi i32
+; CHECK: body:
+; CHECK-NOT: %struct.ACC
+; CHECK: exit:
+; CHECK: store i32
+; CHECK: store i32
+; CHECK: call void @report(%struct.ACC* %acc)
+
+%struct.ACC = type { i32, i32 }
+
+define i32 @average(i32* %v, i32 %n) {
+entry:
+  %acc = alloca %struct.ACC, align 4
+  %0 = bitcast %struct.ACC* %acc to i8*
+  call void @llvm.memset.p0i8.i64(i8* align 4 %0, i8 0, i64 8, i1 false)
+  br label %header
+
+header:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %body ]
+  %cmp = icmp slt i32 %i, %n
+  br i1 %cmp, label %body, label %exit
+
+body:
+  %idx = sext i32 %i to i64
+  %p = getelementptr inbounds i32, i32* %v, i64 %idx
+  %x = load i32, i32* %p, align 4
+  %sum = getelementptr inbounds %struct.ACC, %struct.ACC* %acc, i32 0, i32 0
+  %s = load i32, i32* %sum, align 4
+  %s.next = add nsw i32 %s, %x
+  store i32 %s.next, i32* %sum, align 4
+  %count = getelementptr inbounds %struct.ACC, %struct.ACC* %acc, i32 0, i32 1
+  %c = load i32, i32* %count, align 4
+  %c.next = add nsw i32 %c, 1
+  store i32 %c.next, i32* %count, align 4
+  %i.next = add nsw i32 %i, 1
+  br label %header
+
+exit:
+  call void @report(%struct.ACC* %acc)
+  %sum.out = getelementptr inbounds %struct.ACC, %struct.ACC* %acc, i32 0, i32 0
+  %r = load i32, i32* %sum.out, align 4
+  ret i32 %r
+}
+
+declare void @report(%struct.ACC*)
+declare void @llvm.memset.p0i8.i64(i8* nocapture writeonly, i8, i64, i1)
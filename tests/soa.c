@@ -0,0 +1,20 @@
+struct POINT {
+    float x;
+    float y;
+    float z;
+};
+float sum_x(int n) {
+    struct POINT pts[64];
+    for(int i = 0; i < 64; i++) {
+        pts[i].x = i;
+        pts[i].y = 2 * i;
+        pts[i].z = 3 * i;
+    }
+    float sum = 0;
+    for(int i = 0; i < n && i < 64; i++)
+        sum += pts[i].x;
+    return sum;
+}
+int main () {
+    return sum_x(10);
+}
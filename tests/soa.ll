@@ -0,0 +1,37 @@
+; An array of structs indexed by a variable becomes one array per field. The
+; field arrays keep the alignment of the original array, but their elements
+; are only 8 bytes apart, so the accesses may no longer promise 16.
+; RUN: opt < %s -load SROA.so -scalarrepl-akashk4 -scalarrepl-akashk4-soa -S | FileCheck %s
+; CHECK-LABEL: @sum_x(
+; CHECK-DAG: %pts.f0 = alloca [64 x double], align 16
+; CHECK-DAG: %pts.f1 = alloca [64 x double], align 16
+; CHECK-NOT: alloca [64 x %struct.P]
+; CHECK: store double {{.*}}, align 8
+; CHECK: store double {{.*}}, align 8
+; CHECK: load double, double* {{.*}}, align 8
+
+%struct.P = type { double, double }
+
+define double @sum_x(i32 %n) {
+entry:
+  %pts = alloca [64 x %struct.P], align 16
+  br label %fill
+
+fill:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %fill ]
+  %d = sitofp i64 %i to double
+  %x = getelementptr inbounds [64 x %struct.P], [64 x %struct.P]* %pts, i64 0, i64 %i, i32 0
+  store double %d, double* %x, align 16
+  %y = getelementptr inbounds [64 x %struct.P], [64 x %struct.P]* %pts, i64 0, i64 %i, i32 1
+  store double %d, double* %y, align 8
+  %i.next = add nuw nsw i64 %i, 1
+  %done = icmp eq i64 %i.next, 64
+  br i1 %done, label %read, label %fill
+
+read:
+  %idx = sext i32 %n to i64
+  %e = getelementptr inbounds [64 x %struct.P], [64 x %struct.P]* %pts, i64 0, i64 %idx
+  %ex = getelementptr inbounds %struct.P, %struct.P* %e, i64 0, i32 0
+  %v = load double, double* %ex, align 16
+  ret double %v
+}